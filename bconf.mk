@@ -1,12 +1,87 @@
 CFLAGS+=-std=c11
 CPPFLAGS+=-D_DEFAULT_SOURCE
 
-src/git-host.o: CPPFLAGS+= \
+git-host-cppflags= \
+	-D_GNU_SOURCE \
 	-DCONFIG_GIT_EXEC_PATH='"$(CONFIG_GIT_EXEC_PATH)"' \
-	-DCONFIG_GIT_HOME_REPOSITORIES='"$(CONFIG_GIT_HOME_REPOSITORIES)"'
+	-DCONFIG_GIT_HOME_REPOSITORIES='"$(CONFIG_GIT_HOME_REPOSITORIES)"' \
+	-DCONFIG_GIT_HOME_ARCHIVE_CACHE='"$(CONFIG_GIT_HOME_ARCHIVE_CACHE)"' \
+	-DCONFIG_GIT_ARCHIVE_CACHE_SIZE='$(CONFIG_GIT_ARCHIVE_CACHE_SIZE)ull' \
+	-DCONFIG_GIT_ARCHIVE_GZIP='"$(CONFIG_GIT_ARCHIVE_GZIP)"' \
+	-DCONFIG_GIT_ARCHIVE_ZSTD='"$(CONFIG_GIT_ARCHIVE_ZSTD)"' \
+	-DCONFIG_GIT_ARCHIVE_THREADS='$(CONFIG_GIT_ARCHIVE_THREADS)' \
+	-DCONFIG_GIT_HOME_ACL='"$(CONFIG_GIT_HOME_ACL)"' \
+	-DCONFIG_GIT_HOME_ACL_DATABASE='"$(CONFIG_GIT_HOME_ACL_DATABASE)"' \
+	-DCONFIG_GIT_HOME_TOKEN_KEY='"$(CONFIG_GIT_HOME_TOKEN_KEY)"' \
+	-DCONFIG_GIT_HOME_QUOTA='"$(CONFIG_GIT_HOME_QUOTA)"' \
+	-DCONFIG_GIT_HOME_USAGE='"$(CONFIG_GIT_HOME_USAGE)"' \
+	-DCONFIG_GIT_USER_QUOTA='$(CONFIG_GIT_USER_QUOTA)ull' \
+	-DCONFIG_GIT_REPOSITORY_QUOTA='$(CONFIG_GIT_REPOSITORY_QUOTA)ull' \
+	-DCONFIG_GIT_HOME_JOURNAL='"$(CONFIG_GIT_HOME_JOURNAL)"' \
+	-DCONFIG_GIT_JOURNAL_SEGMENT_SIZE='$(CONFIG_GIT_JOURNAL_SEGMENT_SIZE)ull' \
+	-DCONFIG_GIT_JOURNAL_SEGMENTS='$(CONFIG_GIT_JOURNAL_SEGMENTS)' \
+	-DCONFIG_GIT_HOME_POLICY='"$(CONFIG_GIT_HOME_POLICY)"' \
+	-DCONFIG_GIT_POLICY_THREADS='$(CONFIG_GIT_POLICY_THREADS)' \
+	-DCONFIG_GIT_PUSH_QUEUE_TIMEOUT='$(CONFIG_GIT_PUSH_QUEUE_TIMEOUT)' \
+	-DCONFIG_GIT_HOME_REPLICATION='"$(CONFIG_GIT_HOME_REPLICATION)"' \
+	-DCONFIG_GIT_REPLICATION_MIRROR='"$(CONFIG_GIT_REPLICATION_MIRROR)"' \
+	-DCONFIG_GIT_REPLICATION_DELAY='$(CONFIG_GIT_REPLICATION_DELAY)' \
+	-DCONFIG_GIT_BACKUP_JOBS='$(CONFIG_GIT_BACKUP_JOBS)' \
+	-DCONFIG_GIT_CGROUP='"$(CONFIG_GIT_CGROUP)"' \
+	-DCONFIG_GIT_CGROUP_MEMORY_MAX='"$(CONFIG_GIT_CGROUP_MEMORY_MAX)"' \
+	-DCONFIG_GIT_CGROUP_INTERACTIVE_WEIGHT='$(CONFIG_GIT_CGROUP_INTERACTIVE_WEIGHT)' \
+	-DCONFIG_GIT_CGROUP_BACKGROUND_WEIGHT='$(CONFIG_GIT_CGROUP_BACKGROUND_WEIGHT)' \
+	-DCONFIG_GIT_HOME_SESSIONS='"$(CONFIG_GIT_HOME_SESSIONS)"' \
+	-DCONFIG_GIT_PACK_TUNING='$(CONFIG_GIT_PACK_TUNING)' \
+	-DCONFIG_GIT_BATCH_GROUP='"$(CONFIG_GIT_BATCH_GROUP)"' \
+	-DCONFIG_GIT_BACKGROUND_IDLE='$(CONFIG_GIT_BACKGROUND_IDLE)' \
+	-DCONFIG_GIT_BACKGROUND_NICE='$(CONFIG_GIT_BACKGROUND_NICE)' \
+	-DCONFIG_GIT_HOME_TIERS='"$(CONFIG_GIT_HOME_TIERS)"' \
+	-DCONFIG_GIT_TIER_PROMOTE='$(CONFIG_GIT_TIER_PROMOTE)' \
+	-DCONFIG_GIT_TIER_DEMOTE='$(CONFIG_GIT_TIER_DEMOTE)' \
+	-DCONFIG_GIT_TIER_GRACE='$(CONFIG_GIT_TIER_GRACE)' \
+	-DCONFIG_GIT_HOME_HIBERNATION='"$(CONFIG_GIT_HOME_HIBERNATION)"' \
+	-DCONFIG_GIT_HIBERNATE_DAYS='$(CONFIG_GIT_HIBERNATE_DAYS)' \
+	-DCONFIG_GIT_HOME_REF_FORMAT='"$(CONFIG_GIT_HOME_REF_FORMAT)"' \
+	-DCONFIG_GIT_REF_FORMAT='"$(CONFIG_GIT_REF_FORMAT)"' \
+	-DCONFIG_GIT_REFTABLE_REFS='$(CONFIG_GIT_REFTABLE_REFS)' \
+	-DCONFIG_GIT_HOME_PROFILES='"$(CONFIG_GIT_HOME_PROFILES)"' \
+	-DCONFIG_GIT_PROFILE='"$(CONFIG_GIT_PROFILE)"' \
+	-DCONFIG_GIT_HOME_BROKER='"$(CONFIG_GIT_HOME_BROKER)"' \
+	-DCONFIG_GIT_BROKER_SESSIONS='$(CONFIG_GIT_BROKER_SESSIONS)' \
+	-DCONFIG_GIT_BROKER_USER_SESSIONS='$(CONFIG_GIT_BROKER_USER_SESSIONS)' \
+	-DCONFIG_GIT_BROKER_BACKLOG='$(CONFIG_GIT_BROKER_BACKLOG)'
 
-git-host: src/git-host.o
-ssh-host-authorized-keys: src/ssh-host-authorized-keys.o
+src/git-host.o: CPPFLAGS+=$(git-host-cppflags)
+src/ssh-host-authorized-keys.o: CPPFLAGS+=-D_GNU_SOURCE
+
+git-host: src/git-host.o src/hmac-sha256.o
+git-host: LDLIBS+=-pthread
+ssh-host-authorized-keys: src/ssh-host-authorized-keys.o src/hmac-sha256.o
 
 host-libexec+=git-host ssh-host-authorized-keys
-clean-up+=$(host-libexec) $(host-libexec:%=src/%.o)
+clean-up+=$(host-libexec) $(host-libexec:%=src/%.o) src/hmac-sha256.o
+
+# Parser fuzz targets (libFuzzer) and microbenchmarks, only built on demand and never installed
+fuzz-targets=fuzz/expand-command fuzz/normalize-path fuzz/check-repository-path fuzz/skip-options
+FUZZ_CC=clang
+FUZZ_CFLAGS=-g -O1 -fsanitize=fuzzer,address,undefined
+
+$(fuzz-targets) fuzz/bench: CPPFLAGS+=$(git-host-cppflags)
+$(fuzz-targets): %: %.c fuzz/fuzz-git-host.h src/git-host.c src/ssh-host-authorized-keys.c src/hmac-sha256.c
+	$(FUZZ_CC) $(CFLAGS) $(CPPFLAGS) $(FUZZ_CFLAGS) -o $@ $< src/hmac-sha256.c -pthread
+fuzz/bench: fuzz/bench.c fuzz/fuzz-git-host.h src/git-host.c src/ssh-host-authorized-keys.c src/hmac-sha256.c
+	$(CC) $(CFLAGS) $(CPPFLAGS) -O2 -o $@ $< src/hmac-sha256.c -pthread
+
+.PHONY: fuzz bench
+fuzz: $(fuzz-targets)
+bench: fuzz/bench
+	fuzz/bench
+
+clean-up+=$(fuzz-targets) fuzz/bench
+
+# Tests driving the built git-host in a scratch home, see test/
+.PHONY: check
+check: git-host
+	test/git-host-backup -b ./git-host
+	test/git-host-acl -b ./git-host
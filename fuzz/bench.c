@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "fuzz-git-host.h"
+
+#define main ssh_host_authorized_keys_main
+#include "../src/ssh-host-authorized-keys.c"
+#undef main
+
+#define BENCH_ITERATIONS 1000000
+
+/* Representative inputs of every connection */
+static const char * const commands[] = {
+	"git-upload-pack 'roger/repo'",
+	"git-receive-pack '/roger/repo'",
+	"git-upload-archive \"roger/repo\"",
+	"wait roger/repo refs/heads/ --since 42 --timeout 30",
+};
+
+static const char * const paths[] = {
+	"roger/repo",
+	"/roger/repo/",
+	"./roger/../roger/repo",
+	"roger//repo/.",
+};
+
+static const char * const entries[] = {
+	"ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAI",
+	"no-pty,no-port-forwarding ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAI",
+	"restrict,command=\"git-host\",environment=\"SSH_AUTHORIZED_BY=roger\" ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAI",
+};
+
+static double
+bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *function, const char *input, double start) {
+	printf("%-38s %8.1f ns/op  %s\n", function, (bench_now() - start) / BENCH_ITERATIONS, input);
+}
+
+int
+main(void) {
+	const unsigned int commandscount = sizeof (commands) / sizeof (*commands);
+	const unsigned int pathscount = sizeof (paths) / sizeof (*paths);
+	const unsigned int entriescount = sizeof (entries) / sizeof (*entries);
+
+	unsetenv("SSH_AUTHORIZED_BY");
+	unsetenv("SSH_AUTHORIZED_TOKEN");
+
+	for (unsigned int i = 0; i < commandscount; i++) {
+		const double start = bench_now();
+
+		for (unsigned int n = 0; n < BENCH_ITERATIONS; n++) {
+			char **argv;
+			int argc;
+
+			git_host_expand_command(commands[i], &argc, &argv);
+			for (int a = 0; a < argc; a++) {
+				free(argv[a]);
+			}
+			free(argv);
+		}
+		bench_report("git_host_expand_command", commands[i], start);
+	}
+
+	/* Both include copying the path, as normalization is in place */
+	for (unsigned int i = 0; i < pathscount; i++) {
+		const size_t size = strlen(paths[i]) + 1;
+		const double start = bench_now();
+
+		for (unsigned int n = 0; n < BENCH_ITERATIONS; n++) {
+			char path[size];
+
+			memcpy(path, paths[i], size);
+			if (git_host_normalize_path(path) != 0) {
+				abort();
+			}
+		}
+		bench_report("git_host_normalize_path", paths[i], start);
+	}
+
+	for (unsigned int i = 0; i < pathscount; i++) {
+		const size_t size = strlen(paths[i]) + 1;
+		const double start = bench_now();
+
+		for (unsigned int n = 0; n < BENCH_ITERATIONS; n++) {
+			char path[size];
+
+			memcpy(path, paths[i], size);
+			if (git_host_normalize_path(path) != 0 || git_host_check_repository_path(path, GIT_HOST_MODE_RO) != 0) {
+				abort();
+			}
+		}
+		bench_report("git_host_check_repository_path", paths[i], start);
+	}
+
+	for (unsigned int i = 0; i < entriescount; i++) {
+		volatile size_t skipped = 0;
+		const double start = bench_now();
+
+		for (unsigned int n = 0; n < BENCH_ITERATIONS; n++) {
+			const char *entry = entries[i];
+
+			/* Fails on entries without options, which callers ignore */
+			skipped += ssh_host_authorized_keys_skip_options(&entry) == 0 ? entry - entries[i] : 0;
+		}
+		bench_report("ssh_host_authorized_keys_skip_options", entries[i], start);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "fuzz-git-host.h"
+
+int
+LLVMFuzzerInitialize(int *argcp, char ***argvp) {
+	/* Anonymous reads, from the default rules or the access database of the current directory */
+	unsetenv("SSH_AUTHORIZED_BY");
+	unsetenv("SSH_AUTHORIZED_TOKEN");
+	return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char path[size + 1];
+
+	memcpy(path, data, size);
+	path[size] = '\0';
+
+	if (setjmp(fuzz_rejected) != 0) {
+		abort();
+	}
+
+	if (git_host_normalize_path(path) != 0 || git_host_check_repository_path(path, GIT_HOST_MODE_RO) != 0) {
+		return 0;
+	}
+
+	/* Nothing accepted escapes the <owner>/<repo> shape, nor names git-host's hidden entries */
+	const char * const slash = strchr(path, '/');
+	if (slash == NULL || slash == path || slash[1] == '\0' || strchr(slash + 1, '/') != NULL
+		|| path[0] == '.' || slash[1] == '.') {
+		abort();
+	}
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "fuzz-git-host.h"
+
+/* Outside of the target's frame, to be released after a rejection unwound it */
+static int argc, requotedc;
+static char **argv, **requotedv;
+
+static void
+fuzz_free(int count, char **array) {
+	for (int i = 0; i < count; i++) {
+		free(array[i]);
+	}
+	free(array);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char command[size + 1];
+
+	memcpy(command, data, size);
+	command[size] = '\0';
+
+	if (setjmp(fuzz_rejected) != 0) {
+		fuzz_free(argc, argv);
+		return 0;
+	}
+	git_host_expand_command(command, &argc, &argv);
+
+	/* Words only lose their quotes and separators */
+	size_t length = 0;
+	for (int i = 0; i < argc; i++) {
+		length += strlen(argv[i]);
+	}
+	if (argc == 0 || argv[argc] != NULL || length > strlen(command)) {
+		abort();
+	}
+
+	/* Double quoting every word, with '"' and '\' escaped, expands back to the same words */
+	char requoted[length * 2 + argc * 3 + 1], *it = requoted;
+	for (int i = 0; i < argc; i++) {
+		*it++ = '"';
+		for (const char *c = argv[i]; *c != '\0'; c++) {
+			if (*c == '"' || *c == '\\') {
+				*it++ = '\\';
+			}
+			*it++ = *c;
+		}
+		*it++ = '"';
+		*it++ = ' ';
+	}
+	*it = '\0';
+
+	if (setjmp(fuzz_rejected) != 0) {
+		abort();
+	}
+	git_host_expand_command(requoted, &requotedc, &requotedv);
+
+	if (requotedc != argc) {
+		abort();
+	}
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(requotedv[i], argv[i]) != 0) {
+			abort();
+		}
+	}
+
+	fuzz_free(requotedc, requotedv);
+	fuzz_free(argc, argv);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef FUZZ_GIT_HOST_H
+#define FUZZ_GIT_HOST_H
+
+/*
+ * git-host's parsers built into a fuzz target or benchmark,
+ * where rejected input unwinds back to the caller instead of exiting.
+ */
+#include <err.h>
+#include <setjmp.h>
+
+static jmp_buf fuzz_rejected;
+
+#define errx(status, ...) longjmp(fuzz_rejected, 1)
+#define main git_host_main
+#include "../src/git-host.c"
+#undef main
+#undef errx
+
+#endif
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "fuzz-git-host.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char path[size + 1], again[size + 1];
+
+	memcpy(path, data, size);
+	path[size] = '\0';
+
+	if (git_host_normalize_path(path) != 0) {
+		return 0;
+	}
+
+	/* Idempotent */
+	memcpy(again, path, strlen(path) + 1);
+	if (git_host_normalize_path(again) != 0 || strcmp(again, path) != 0) {
+		abort();
+	}
+
+	/* Relative, without empty, "." nor ".." components */
+	for (const char *component = path, *end; component != NULL; component = *end != '\0' ? end + 1 : NULL) {
+		end = strchrnul(component, '/');
+
+		if (end == component
+			|| (end - component == 1 && component[0] == '.')
+			|| (end - component == 2 && component[0] == '.' && component[1] == '.')) {
+			abort();
+		}
+	}
+
+	return 0;
+}
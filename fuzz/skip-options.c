@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include <stdint.h>
+
+#define main ssh_host_authorized_keys_main
+#include "../src/ssh-host-authorized-keys.c"
+#undef main
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static const char restrict_[] = "restrict,";
+	char entry[sizeof (restrict_) - 1 + size + 1];
+	char * const line = entry + sizeof (restrict_) - 1;
+
+	memcpy(entry, restrict_, sizeof (restrict_) - 1);
+	memcpy(line, data, size);
+	line[size] = '\0';
+
+	const size_t length = strlen(line);
+	const char *skipped = line;
+	const int status = ssh_host_authorized_keys_skip_options(&skipped);
+
+	/* Options end within the line, at its end or at the blank before the key type */
+	if (status == 0 && (skipped < line || skipped > line + length
+		|| (*skipped != '\0' && *skipped != ' ' && *skipped != '\t'))) {
+		abort();
+	}
+
+	/* Options following a valid one are parsed alike, up to the same end */
+	if (*line != '\0' && *line != ' ' && *line != '\t') {
+		const char *prefixed = entry;
+
+		if (ssh_host_authorized_keys_skip_options(&prefixed) != status || (status == 0 && prefixed != skipped)) {
+			abort();
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef GIT_HOST_ACL_H
+#define GIT_HOST_ACL_H
+
+#include <stdint.h>
+
+/* Compiled access-control database layout, written by git-host -m acl-compile */
+#define GIT_HOST_ACL_MAGIC "GHACL\0\0\1"
+
+struct git_host_acl_header {
+	char magic[8];
+	uint64_t epoch;
+	uint32_t buckets;
+	uint32_t slots;
+	uint64_t strings;
+	/* uint32_t seeds[buckets]; */
+	/* struct git_host_acl_slot slots[slots]; */
+	/* char strings[strings]; */
+};
+
+struct git_host_acl_slot {
+	uint32_t offset;
+	uint16_t length;
+	uint16_t mode;
+};
+
+#endif
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef GIT_HOST_PROBE_H
+#define GIT_HOST_PROBE_H
+
+/*
+ * Statically defined tracepoints (USDT), for bpftrace(8) or perf(1), when built with systemtap's <sys/sdt.h>.
+ * Until a tracer attaches, a probe is a single nop, and its arguments must only be values at hand.
+ * Those are scalars or pointers, <sys/sdt.h> casts each to its own type, which arrays can't be cast to.
+ */
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define GIT_HOST_PROBE STAP_PROBEV
+#endif
+#endif
+
+#ifndef GIT_HOST_PROBE
+#define GIT_HOST_PROBE(...) ((void)0)
+#endif
+
+#endif
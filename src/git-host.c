@@ -1,17 +1,54 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdnoreturn.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <ftw.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
 #include <errno.h>
+#include <grp.h>
+#include <pwd.h>
 #include <err.h>
 
+#include "git-host-acl.h"
+#include "git-host-probe.h"
+#include "hmac-sha256.h"
+
 struct git_host_args {
 	const char *command;
+	const char *maintenance;
 };
 
+/* Same limits as git's pkt-line.h and archive.h */
+#define GIT_HOST_PACKET_MAX     65520
+#define GIT_HOST_SIDEBAND_MAX   (GIT_HOST_PACKET_MAX - 5)
+#define GIT_HOST_ARCHIVE_ARGS   64
+
 enum git_host_mode {
 	GIT_HOST_MODE_NA,
 	GIT_HOST_MODE_RO,
@@ -19,12 +56,18 @@ enum git_host_mode {
 	GIT_HOST_MODE_RW,
 };
 
+/* Interactive sessions are favored over background work */
+enum git_host_class {
+	GIT_HOST_CLASS_INTERACTIVE,
+	GIT_HOST_CLASS_BACKGROUND,
+};
+
 static char *
 xstrdup(const char *s) {
 	char * const c = strdup(s);
 
 	if (c == NULL) {
-		err(EXIT_FAILURE, "strdup %s", c);
+		err(EXIT_FAILURE, "strdup %s", s);
 	}
 
 	return c;
@@ -120,6 +163,8 @@ git_host_expand_command(const char *command, int *argcp, char ***argvp) {
 
 	git_host_array_push(NULL, argcp, argvp);
 	--*argcp;
+
+	GIT_HOST_PROBE(git_host, command, command, *argcp, **argvp);
 }
 
 static char *
@@ -145,6 +190,346 @@ git_host_execpath(const char *file) {
 	return git_host_pathcat(execpath, file);
 }
 
+static void
+git_host_write_full(int fd, const void *data, size_t size) {
+	const char *it = data;
+
+	while (size != 0) {
+		const ssize_t written = write(fd, it, size);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "write");
+		}
+
+		it += written;
+		size -= written;
+	}
+}
+
+static int
+git_host_read_full(int fd, void *data, size_t size) {
+	char *it = data;
+
+	while (size != 0) {
+		const ssize_t readed = read(fd, it, size);
+
+		if (readed <= 0) {
+			if (readed < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		it += readed;
+		size -= readed;
+	}
+
+	return 0;
+}
+
+static void
+git_host_packet_write(int fd, const void *data, size_t size) {
+	char header[5];
+
+	if (size > GIT_HOST_PACKET_MAX - 4) {
+		errx(EXIT_FAILURE, "Packet of %zu bytes exceeds the maximum packet length", size);
+	}
+
+	snprintf(header, sizeof (header), "%04x", (unsigned int)size + 4);
+	git_host_write_full(fd, header, 4);
+	git_host_write_full(fd, data, size);
+}
+
+static void
+git_host_packet_flush(int fd) {
+	git_host_write_full(fd, "0000", 4);
+}
+
+static char *
+git_host_packet_read(int fd) {
+	/* Returns NULL on flush, the payload without its trailing newline otherwise */
+	char header[5] = { 0 }, *end;
+
+	if (git_host_read_full(fd, header, 4) != 0) {
+		errx(EXIT_FAILURE, "Unexpected end of packet stream");
+	}
+
+	const unsigned long length = strtoul(header, &end, 16);
+	if (*end != '\0' || (length != 0 && length <= 4) || length > GIT_HOST_PACKET_MAX) {
+		errx(EXIT_FAILURE, "Invalid packet length '%s'", header);
+	}
+
+	if (length == 0) {
+		return NULL;
+	}
+
+	char * const payload = malloc(length - 3);
+	if (payload == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	if (git_host_read_full(fd, payload, length - 4) != 0) {
+		errx(EXIT_FAILURE, "Unexpected end of packet stream");
+	}
+
+	payload[length - 4] = '\0';
+	if (length > 4 && payload[length - 5] == '\n') {
+		payload[length - 5] = '\0';
+	}
+
+	return payload;
+}
+
+static void
+git_host_sideband_write(int band, const void *data, size_t size) {
+	const char *it = data;
+
+	while (size != 0) {
+		const size_t chunk = size < GIT_HOST_SIDEBAND_MAX ? size : GIT_HOST_SIDEBAND_MAX;
+		char header[6];
+
+		snprintf(header, sizeof (header), "%04zx%c", chunk + 5, band);
+		git_host_write_full(STDOUT_FILENO, header, 5);
+		git_host_write_full(STDOUT_FILENO, it, chunk);
+
+		it += chunk;
+		size -= chunk;
+	}
+}
+
+static void
+git_host_sideband_sendfile(int fd, off_t offset) {
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		err(EXIT_FAILURE, "fstat");
+	}
+
+	while (offset < st.st_size) {
+		const off_t remaining = st.st_size - offset;
+		const size_t chunk = remaining < GIT_HOST_SIDEBAND_MAX ? remaining : GIT_HOST_SIDEBAND_MAX;
+		char header[6];
+
+		snprintf(header, sizeof (header), "%04zx%c", chunk + 5, 1);
+		git_host_write_full(STDOUT_FILENO, header, 5);
+
+		size_t sent = 0;
+		while (sent != chunk) {
+			const ssize_t ret = sendfile(STDOUT_FILENO, fd, &offset, chunk - sent);
+
+			if (ret <= 0) {
+				if (ret < 0 && errno == EINTR) {
+					continue;
+				}
+				err(EXIT_FAILURE, "sendfile");
+			}
+
+			sent += ret;
+		}
+	}
+}
+
+static pid_t
+git_host_spawn(const char *path, char * const argv[], int in, int out, int errfd) {
+	const pid_t pid = fork();
+
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		if ((in >= 0 && dup2(in, STDIN_FILENO) < 0)
+			|| (out >= 0 && dup2(out, STDOUT_FILENO) < 0)
+			|| (errfd >= 0 && dup2(errfd, STDERR_FILENO) < 0)) {
+			err(-1, "dup2");
+		}
+
+		execv(path, argv);
+		err(-1, "exec %s", *argv);
+	}
+
+	return pid;
+}
+
+static int
+git_host_wait(pid_t pid) {
+	int wstatus;
+
+	while (waitpid(pid, &wstatus, 0) < 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "waitpid");
+		}
+	}
+
+	return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+}
+
+static int
+git_host_capture(char * const argv[], char *buffer, size_t size) {
+	/* Runs the git command argv, storing its first output line in buffer */
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), argv, -1, fds[1], -1);
+	size_t length = 0;
+	ssize_t readed;
+
+	close(fds[1]);
+	while (readed = read(fds[0], buffer + length, size - 1 - length), readed > 0 || (readed < 0 && errno == EINTR)) {
+		if (readed > 0) {
+			length += readed;
+		}
+	}
+	close(fds[0]);
+
+	buffer[length] = '\0';
+	buffer[strcspn(buffer, "\n")] = '\0';
+
+	return git_host_wait(pid);
+}
+
+static int
+git_host_refs_compare(const void *lhs, const void *rhs) {
+	/* Lines are <oid> <ref>, ordered by ref */
+	const char * const * const lref = lhs, * const * const rref = rhs;
+
+	return strcmp(strchr(*lref, ' '), strchr(*rref, ' '));
+}
+
+static int
+git_host_refs_read(char * const argv[], char ***refsp) {
+	/* Reads the <oid> <ref> lines output by the git command argv, returns their count or -1 */
+	char *line = NULL;
+	int fds[2], count = 0;
+	size_t n = 0;
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), argv, -1, fds[1], -1);
+	FILE * const filep = fdopen(fds[0], "r");
+
+	close(fds[1]);
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	*refsp = NULL;
+	while (getline(&line, &n, filep) >= 0) {
+		const char * const ref = strchr(line, ' ');
+
+		/* Bundles also list HEAD */
+		line[strcspn(line, "\n")] = '\0';
+		if (ref != NULL && strncmp(ref + 1, "refs/", 5) == 0) {
+			git_host_array_push(xstrdup(line), &count, refsp);
+		}
+	}
+	free(line);
+	fclose(filep);
+
+	if (git_host_wait(pid) != 0) {
+		return -1;
+	}
+
+	qsort(*refsp, count, sizeof (**refsp), git_host_refs_compare);
+
+	return count;
+}
+
+static int
+git_host_refs(const char *gitdir, char ***refsp) {
+	/* Lists refs of a repository as <oid> <ref> lines, returns their count or -1 */
+	char *gitdirarg;
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", gitdir) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	char * const argv[] = { "git", gitdirarg, "for-each-ref", "--format=%(objectname) %(refname)", NULL };
+	const int count = git_host_refs_read(argv, refsp);
+
+	free(gitdirarg);
+
+	return count;
+}
+
+static uint64_t
+git_host_fnv1a(const char *string) {
+	uint64_t hash = 0xcbf29ce484222325;
+
+	while (*string != '\0') {
+		hash ^= (unsigned char)*string++;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+static unsigned int
+git_host_threads(unsigned int threads) {
+	/* At most threads, but no more than there are online processors, nor than the share a broker started the session with */
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+	const char * const share = getenv("GIT_HOST_THREADS");
+
+	if (online > 0 && (unsigned long)online < threads) {
+		threads = online;
+	}
+
+	if (share != NULL && strtoul(share, NULL, 10) < threads) {
+		threads = strtoul(share, NULL, 10);
+	}
+
+	return threads != 0 ? threads : 1;
+}
+
+static int
+git_host_which(const char *command) {
+	/* Whether a non-empty command can be found in the PATH, the same way the archive filter's shell would */
+	const char *path = getenv("PATH");
+
+	if (*command == '\0') {
+		return -1;
+	}
+
+	if (strchr(command, '/') != NULL) {
+		return access(command, X_OK);
+	}
+
+	if (path == NULL) {
+		path = "/usr/bin:/bin";
+	}
+
+	while (*path != '\0') {
+		const size_t length = strcspn(path, ":");
+		char directory[length + 2];
+
+		memcpy(directory, path, length);
+		directory[length] = '\0';
+
+		char * const candidate = git_host_pathcat(length != 0 ? directory : ".", command);
+		const int ret = access(candidate, X_OK);
+		free(candidate);
+
+		if (ret == 0) {
+			return 0;
+		}
+
+		path += length;
+		if (*path == ':') {
+			path++;
+		}
+	}
+
+	return -1;
+}
+
 static int
 git_host_normalize_path(char *path) {
 	enum {
@@ -242,164 +627,6377 @@ git_host_normalize_path(char *path) {
 }
 
 static int
-git_host_check_repository_path(const char *path, enum git_host_mode mode) {
-	/* Only paths of the form <toplevel>/<git dir> are allowed to reference repositories */
+git_host_check_repository_shape(const char *path) {
+	/* Only paths of the form <toplevel>/<git dir> are allowed to reference repositories, hidden names are git-host's */
 	const char * const s = strchr(path, '/');
 
-	if (s == NULL || s[1] == '.' || strchr(s + 1, '/') != NULL) {
+	if (s == NULL || *path == '.' || s[1] == '.' || strchr(s + 1, '/') != NULL) {
 		return -1;
 	}
 
-	if (mode & GIT_HOST_MODE_WR) {
-		const char * const authorized = getenv("SSH_AUTHORIZED_BY");
+	return 0;
+}
 
-		if (authorized == NULL) {
-			errx(EXIT_FAILURE, "Missing authorization");
-		}
+struct git_host_acl {
+	const struct git_host_acl_header *header;
+	const uint32_t *seeds;
+	const struct git_host_acl_slot *slots;
+	const char *strings;
+};
 
-		const size_t authorizedlen = strlen(authorized);
-		if (authorizedlen != s - path
-			|| strncmp(path, authorized, authorizedlen) != 0) {
-			return -1;
+static uint64_t
+git_host_acl_hash(const char *key, size_t length, uint32_t seed) {
+	uint64_t hash = 0xcbf29ce484222325 ^ (seed * 0x9e3779b97f4a7c15);
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 0x100000001b3;
+	}
+
+	/* FNV-1a's high bits are weak, finalize them as splitmix64 does */
+	hash ^= hash >> 31;
+	hash *= 0xbf58476d1ce4e5b9;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+static const struct git_host_acl *
+git_host_acl_open(void) {
+	/* Mapped once per process, absence of the database means default rules only */
+	static struct git_host_acl acl;
+	static int opened;
+
+	if (opened) {
+		return acl.header != NULL ? &acl : NULL;
+	}
+	opened = 1;
+
+	const int fd = open(CONFIG_GIT_HOME_ACL_DATABASE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "open "CONFIG_GIT_HOME_ACL_DATABASE);
 		}
+		return NULL;
 	}
 
-	return 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		err(EXIT_FAILURE, "fstat "CONFIG_GIT_HOME_ACL_DATABASE);
+	}
+
+	const struct git_host_acl_header * const header = st.st_size >= sizeof (*header)
+		? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	if (header == MAP_FAILED || memcmp(header->magic, GIT_HOST_ACL_MAGIC, sizeof (header->magic)) != 0
+		|| header->buckets == 0 || header->slots == 0
+		|| st.st_size != sizeof (*header) + header->buckets * sizeof (*acl.seeds)
+			+ header->slots * sizeof (*acl.slots) + header->strings) {
+		errx(EXIT_FAILURE, "Invalid access-control database "CONFIG_GIT_HOME_ACL_DATABASE);
+	}
+
+	acl.header = header;
+	acl.seeds = (const uint32_t *)(header + 1);
+	acl.slots = (const struct git_host_acl_slot *)(acl.seeds + header->buckets);
+	acl.strings = (const char *)(acl.slots + header->slots);
+
+	return &acl;
+}
+
+static int
+git_host_acl_find(const struct git_host_acl *acl, const char *user, const char *path) {
+	const size_t userlen = strlen(user), pathlen = strlen(path);
+	char key[userlen + pathlen + 2];
+
+	memcpy(key, user, userlen);
+	key[userlen] = ' ';
+	memcpy(key + userlen + 1, path, pathlen + 1);
+
+	const size_t keylen = userlen + pathlen + 1;
+	const uint32_t bucket = git_host_acl_hash(key, keylen, 0) % acl->header->buckets;
+	const struct git_host_acl_slot * const slot = acl->slots
+		+ git_host_acl_hash(key, keylen, acl->seeds[bucket]) % acl->header->slots;
+
+	if (slot->length != keylen || slot->offset + keylen > acl->header->strings
+		|| memcmp(acl->strings + slot->offset, key, keylen) != 0) {
+		return -1;
+	}
+
+	return slot->mode;
 }
 
 static char *
-git_host_repository(const char *raw, enum git_host_mode mode) {
-	char path[strlen(raw) + 1];
+git_host_token_key(size_t *sizep) {
+	static char key[4096];
+	size_t size = 0;
+	ssize_t readed;
 
-	memcpy(path, raw, sizeof (path));
-	if (git_host_normalize_path(path) != 0 || git_host_check_repository_path(path, mode) != 0) {
-		errx(EXIT_FAILURE, "Invalid repository path '%s' '%s'", path, raw);
+	const int fd = open(CONFIG_GIT_HOME_TOKEN_KEY, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open "CONFIG_GIT_HOME_TOKEN_KEY);
 	}
 
-	return git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path);
+	while (readed = read(fd, key + size, sizeof (key) - size), readed > 0) {
+		size += readed;
+	}
+	close(fd);
+
+	if (readed < 0 || size == 0) {
+		errx(EXIT_FAILURE, "Unable to read token key "CONFIG_GIT_HOME_TOKEN_KEY);
+	}
+
+	*sizep = size;
+	return key;
 }
 
 static int
-git_host_dir_filter(const struct dirent *entry) {
-	return *entry->d_name != '.';
-}
+git_host_token_groups(const char *user, uint64_t epoch, char ***groupsp) {
+	/* A verified token carries <epoch>:<group>,...:<mac>, only trusted if the rules didn't change since */
+	const char * const token = getenv("SSH_AUTHORIZED_TOKEN");
+	const char *mac;
+	char *end;
+	int count = 0;
 
-static void
-git_host_dir(const char *directory) {
-	struct dirent **namelist;
-	int count;
+	if (token == NULL) {
+		return -1;
+	}
 
-	count = scandir(directory, &namelist, git_host_dir_filter, alphasort);
-	if (count < 0) {
-		err(EXIT_FAILURE, "scandir %s", directory);
+	const unsigned long long tokenepoch = strtoull(token, &end, 10);
+	if (*end != ':' || (mac = strrchr(end + 1, ':')) == NULL) {
+		errx(EXIT_FAILURE, "Invalid authorization token");
 	}
 
-	printf("%s:\n", directory);
-	for (int i = 0; i < count; i++) {
-		struct dirent * const entry = namelist[i];
+	const size_t userlen = strlen(user), signedlen = mac - token;
+	char message[userlen + 1 + signedlen + 1], expected[SHA256_DIGEST_SIZE * 2 + 1];
+	size_t keysize;
 
-		printf("\t%s/%s\n", directory, entry->d_name);
+	memcpy(message, user, userlen);
+	message[userlen] = ':';
+	memcpy(message + userlen + 1, token, signedlen);
+	message[userlen + 1 + signedlen] = '\0';
 
-		free(entry);
+	const char * const key = git_host_token_key(&keysize);
+	hmac_sha256_hex(key, keysize, message, userlen + 1 + signedlen, expected);
+	if (!hmac_sha256_hex_equals(expected, mac + 1)) {
+		errx(EXIT_FAILURE, "Invalid authorization token");
 	}
 
-	free(namelist);
+	if (tokenepoch != epoch) {
+		return -1;
+	}
+
+	char *groups = message + userlen + 1 + (end - token) + 1, *saveptr;
+
+	for (char *group = strtok_r(groups, ",", &saveptr); group != NULL; group = strtok_r(NULL, ",", &saveptr)) {
+		git_host_array_push(xstrdup(group), &count, groupsp);
+	}
+
+	return count;
 }
 
-static void noreturn
-git_host_exec_dir(int argc, char **argv) {
+static int
+git_host_groups(const char *user, uint64_t epoch, char ***groupsp) {
+	/* Groups of the user, from the authorization token when possible, else from the name service */
+	static char **groups;
+	static int count = -1;
 
-	if (chdir(CONFIG_GIT_HOME_REPOSITORIES) != 0) {
-		err(EXIT_FAILURE, "chdir "CONFIG_GIT_HOME_REPOSITORIES);
+	if (count >= 0) {
+		*groupsp = groups;
+		return count;
 	}
 
-	if (argc == 1) {
-		DIR * const dirp = opendir(".");
-		struct dirent *entry;
+	if (count = git_host_token_groups(user, epoch, &groups), count < 0) {
+		const struct passwd * const pw = getpwnam(user);
+		gid_t *gids = NULL;
+		int ngids = 0;
 
-		while (errno = 0, entry = readdir(dirp)) {
-			if (*entry->d_name != '.') {
-				git_host_dir(entry->d_name);
+		count = 0;
+		if (pw != NULL) {
+			while (getgrouplist(user, pw->pw_gid, gids, &ngids) < 0) {
+				gids = realloc(gids, sizeof (*gids) * ngids);
+				if (gids == NULL) {
+					err(EXIT_FAILURE, "realloc");
+				}
 			}
-		}
 
-		closedir(dirp);
-	} else {
-		for (int i = 1; i < argc; i++) {
-			if (*argv[i] != '.') {
-				git_host_dir(argv[i]);
+			for (int i = 0; i < ngids; i++) {
+				const struct group * const gr = getgrgid(gids[i]);
+
+				if (gr != NULL) {
+					git_host_array_push(xstrdup(gr->gr_name), &count, &groups);
+				}
 			}
 		}
+
+		free(gids);
+		GIT_HOST_PROBE(git_host, groups, user, count, 0);
+	} else {
+		GIT_HOST_PROBE(git_host, groups, user, count, 1);
 	}
 
-	exit(EXIT_SUCCESS);
+	*groupsp = groups;
+	return count;
 }
 
-static void noreturn
-git_host_exec_init(int argc, char **argv) {
-	static const char argv0[] = "git-init";
+static enum git_host_mode
+git_host_acl_mode(const char *user, const char *path) {
+	/* An explicit grant for the user, else owner's default, else its groups' and the repository's public mode */
+	const struct git_host_acl * const acl = git_host_acl_open();
+	int mode, publicmode = GIT_HOST_MODE_RO;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <repository>\n", *argv);
-		exit(EXIT_FAILURE);
-	}
+	if (user != NULL) {
+		const size_t userlen = strlen(user);
 
-	execl(git_host_execpath(argv0), argv0, "--quiet", "--bare", "--", git_host_repository(argv[1], GIT_HOST_MODE_WR), NULL);
-	err(-1, "exec %s", argv0);
-}
+		if (acl != NULL && (mode = git_host_acl_find(acl, user, path)) >= 0) {
+			return mode;
+		}
 
-static void noreturn
-git_host_exec_rx_tx(int argc, char **argv, enum git_host_mode mode) {
+		if (strncmp(path, user, userlen) == 0 && path[userlen] == '/') {
+			return GIT_HOST_MODE_RW;
+		}
+	}
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <repository>\n", *argv);
-		exit(EXIT_FAILURE);
+	if (acl == NULL) {
+		return publicmode;
 	}
 
-	execl(git_host_execpath(argv[0]), argv[0], git_host_repository(argv[1], mode), NULL);
-	err(-1, "exec %s", *argv);
-}
+	if ((mode = git_host_acl_find(acl, "*", path)) >= 0) {
+		publicmode = mode;
+	}
+
+	if (user != NULL) {
+		char **groups;
+		const int count = git_host_groups(user, acl->header->epoch, &groups);
+
+		for (int i = 0; i < count; i++) {
+			const size_t grouplen = strlen(groups[i]);
+			char principal[grouplen + 2];
+
+			principal[0] = '%';
+			memcpy(principal + 1, groups[i], grouplen + 1);
+			if ((mode = git_host_acl_find(acl, principal, path)) >= 0) {
+				publicmode |= mode;
+			}
+		}
+	}
+
+	return publicmode;
+}
+
+static int
+git_host_check_repository_path(const char *path, enum git_host_mode mode) {
+	const char * const authorized = getenv("SSH_AUTHORIZED_BY");
+
+	if (git_host_check_repository_shape(path) != 0) {
+		return -1;
+	}
+
+	if ((mode & GIT_HOST_MODE_WR) && authorized == NULL) {
+		errx(EXIT_FAILURE, "Missing authorization");
+	}
+
+	if ((git_host_acl_mode(authorized, path) & mode) != mode) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Deleted repositories, out of reach of repository paths, see git_host_maintenance_reap() */
+#define GIT_HOST_TRASH CONFIG_GIT_HOME_REPOSITORIES"/.trash"
+
+/* Per-repository access statistics, see git_host_access_stamp() */
+#define GIT_HOST_ACCESS "git-host-access"
+#define GIT_HOST_ACCESS_HALF_LIFE (7 * 86400)
+
+struct git_host_access {
+	int64_t last;
+	int64_t decayed;
+	double score;
+};
+
+static void
+git_host_access_decay(struct git_host_access *access, int64_t now) {
+	/* The score halves every half-life, so it tells recent accesses rather than total ones */
+	if (now - access->decayed >= 64 * GIT_HOST_ACCESS_HALF_LIFE) {
+		access->score = 0;
+		access->decayed = now;
+	}
+
+	while (now - access->decayed >= GIT_HOST_ACCESS_HALF_LIFE) {
+		access->score /= 2;
+		access->decayed += GIT_HOST_ACCESS_HALF_LIFE;
+	}
+}
+
+static int
+git_host_access_read(const char *repository, struct git_host_access *access) {
+	/* Returns -1, with zeroed statistics, if the repository was never accessed since stamps exist */
+	char * const path = git_host_pathcat(repository, GIT_HOST_ACCESS);
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	int ret = -1;
+
+	memset(access, 0, sizeof (*access));
+	if (fd >= 0) {
+		if (pread(fd, access, sizeof (*access), 0) == sizeof (*access)) {
+			ret = 0;
+		} else {
+			memset(access, 0, sizeof (*access));
+		}
+		close(fd);
+	}
+
+	free(path);
+
+	return ret;
+}
+
+static void
+git_host_access_stamp(const char *repository) {
+	/*
+	 * Records an access to the repository, for storage tiering. Best effort and unlocked:
+	 * concurrent sessions may lose each other's increments, which doesn't matter for a score.
+	 */
+	char * const path = git_host_pathcat(repository, GIT_HOST_ACCESS);
+	const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd >= 0) {
+		struct git_host_access access = { 0 };
+		const int64_t now = time(NULL);
+
+		if (pread(fd, &access, sizeof (access), 0) != sizeof (access)) {
+			memset(&access, 0, sizeof (access));
+			access.decayed = now;
+		}
+
+		git_host_access_decay(&access, now);
+		access.score += 1;
+		access.last = now;
+
+		if (pwrite(fd, &access, sizeof (access), 0) != sizeof (access)) {
+			warn("Unable to stamp %s", path);
+		}
+		close(fd);
+	}
+
+	free(path);
+}
+
+static char *
+git_host_sibling(const char *location, const char *suffix) {
+	/* Hidden name next to a repository, <owner>/.<repo>.<suffix>, ignored by listings */
+	const char * const name = strrchr(location, '/') + 1;
+	const size_t length = strlen(location) + strlen(suffix) + 3;
+	char * const sibling = malloc(length);
+
+	if (sibling == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	snprintf(sibling, length, "%.*s.%s.%s", (int)(name - location), location, name, suffix);
+
+	return sibling;
+}
+
+static void
+git_host_tree_remove(int dirfd, const char *name) {
+	if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) {
+		return;
+	}
+
+	const int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR * const dirp = fd >= 0 ? fdopendir(fd) : NULL;
+	const struct dirent *entry;
+
+	if (dirp == NULL) {
+		warn("Unable to remove %s", name);
+		return;
+	}
+
+	while (entry = readdir(dirp), entry != NULL) {
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+			git_host_tree_remove(fd, entry->d_name);
+		}
+	}
+
+	closedir(dirp);
+
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) != 0) {
+		warn("Unable to remove %s", name);
+	}
+}
+
+/* Single-file archives of idle repositories, see git_host_hibernate() */
+#define GIT_HOST_HIBERNATION_MAGIC "GHHIBR\0\1"
+#define GIT_HOST_HIBERNATION_BUNDLE "git-host-bundle"
+#define GIT_HOST_HIBERNATION_HELD "git-host-"
+
+struct git_host_hibernation_entry {
+	uint32_t mode;
+	uint32_t namelength;
+	uint64_t size;
+};
+
+struct git_host_hibernation_stats {
+	uint64_t thaws;
+	uint64_t total;
+	uint64_t max;
+};
+
+static void
+git_host_hibernation_copy(int in, int out, uint64_t size) {
+	/* Copies from the current offset of in to the current offset of out */
+	while (size != 0) {
+		const ssize_t copied = sendfile(out, in, NULL, size);
+
+		if (copied <= 0) {
+			if (copied < 0 && errno == EINTR) {
+				continue;
+			}
+			errx(EXIT_FAILURE, "Unable to copy %llu bytes of hibernated repository", (unsigned long long)size);
+		}
+
+		size -= copied;
+	}
+}
+
+static void
+git_host_hibernation_record(uint64_t elapsed) {
+	/* Accounts a thaw which took elapsed microseconds */
+	const int fd = open(CONFIG_GIT_HOME_HIBERNATION, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	struct git_host_hibernation_stats stats = { 0 };
+
+	if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+		warn("Unable to account thaw in "CONFIG_GIT_HOME_HIBERNATION);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+
+	if (pread(fd, &stats, sizeof (stats), 0) != sizeof (stats)) {
+		memset(&stats, 0, sizeof (stats));
+	}
+
+	stats.thaws++;
+	stats.total += elapsed;
+	if (elapsed > stats.max) {
+		stats.max = elapsed;
+	}
+
+	if (pwrite(fd, &stats, sizeof (stats), 0) != sizeof (stats)) {
+		warn("Unable to account thaw in "CONFIG_GIT_HOME_HIBERNATION);
+	}
+	close(fd);
+}
+
+static int
+git_host_thaw(const char *repository, const char *path) {
+	/*
+	 * Thaws a hibernated repository in place, returns 1 if it was hibernated.
+	 * Concurrent sessions serialize on the archive's lock, the later ones find the repository thawed.
+	 */
+	const int fd = open(repository, O_RDONLY | O_CLOEXEC);
+	struct stat st, current;
+
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	while (flock(fd, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "flock %s", repository);
+		}
+	}
+
+	if (stat(repository, &current) != 0 || current.st_dev != st.st_dev || current.st_ino != st.st_ino) {
+		close(fd);
+		return 1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	warnx("Thawing '%s'...", path);
+
+	/* Leftovers of an interrupted thaw are started over, the lock ensures nobody else is thawing */
+	char * const staging = git_host_sibling(repository, "thawing");
+	git_host_tree_remove(AT_FDCWD, staging);
+
+	int stagingfd;
+	char magic[sizeof (GIT_HOST_HIBERNATION_MAGIC) - 1];
+	if (mkdir(staging, 0777) != 0 || (stagingfd = open(staging, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+	}
+
+	if (git_host_read_full(fd, magic, sizeof (magic)) != 0 || memcmp(magic, GIT_HOST_HIBERNATION_MAGIC, sizeof (magic)) != 0) {
+		errx(EXIT_FAILURE, "Invalid hibernated repository '%s'", path);
+	}
+
+	struct git_host_hibernation_entry entry;
+	int bundle = 0;
+	while (git_host_read_full(fd, &entry, sizeof (entry)) == 0) {
+		if (entry.namelength >= PATH_MAX || (S_ISLNK(entry.mode) && entry.size >= PATH_MAX)) {
+			errx(EXIT_FAILURE, "Invalid hibernated repository '%s'", path);
+		}
+
+		char name[entry.namelength + 1];
+		if (git_host_read_full(fd, name, entry.namelength) != 0) {
+			errx(EXIT_FAILURE, "Invalid hibernated repository '%s'", path);
+		}
+		name[entry.namelength] = '\0';
+
+		/* Refs are held aside until their objects are unbundled, git refuses to run with dangling ones */
+		char held[sizeof (GIT_HOST_HIBERNATION_HELD) + entry.namelength];
+		const char *file = name;
+
+		if (strcmp(name, "packed-refs") == 0 || strcmp(name, "reftable") == 0 || strncmp(name, "reftable/", 9) == 0) {
+			snprintf(held, sizeof (held), GIT_HOST_HIBERNATION_HELD"%s", name);
+			file = held;
+		}
+
+		if (S_ISDIR(entry.mode)) {
+			if (mkdirat(stagingfd, file, entry.mode & 07777) != 0 && errno != EEXIST) {
+				err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+			}
+		} else if (S_ISLNK(entry.mode)) {
+			char target[entry.size + 1];
+
+			if (git_host_read_full(fd, target, entry.size) != 0) {
+				errx(EXIT_FAILURE, "Invalid hibernated repository '%s'", path);
+			}
+			target[entry.size] = '\0';
+
+			if (symlinkat(target, stagingfd, file) != 0) {
+				err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+			}
+		} else {
+			const int out = openat(stagingfd, file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, entry.mode & 07777);
+
+			if (out < 0) {
+				err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+			}
+			git_host_hibernation_copy(fd, out, entry.size);
+			close(out);
+
+			bundle |= strcmp(name, GIT_HOST_HIBERNATION_BUNDLE) == 0;
+		}
+	}
+
+	/* A reftable repository is given an empty stack of tables meanwhile */
+	const int reftable = faccessat(stagingfd, GIT_HOST_HIBERNATION_HELD"reftable", F_OK, 0) == 0;
+	int tablesfd;
+
+	if (reftable && (mkdirat(stagingfd, "reftable", 0777) != 0
+		|| (tablesfd = openat(stagingfd, "reftable/tables.list", O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)) {
+		err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+	} else if (reftable) {
+		close(tablesfd);
+	}
+
+	if (bundle) {
+		char * const bundlepath = git_host_pathcat(staging, GIT_HOST_HIBERNATION_BUNDLE);
+		char *gitdirarg;
+
+		if (asprintf(&gitdirarg, "--git-dir=%s", staging) < 0) {
+			err(EXIT_FAILURE, "asprintf");
+		}
+
+		char * const unbundleargv[] = { "git", gitdirarg, "bundle", "unbundle", bundlepath, NULL };
+		const int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+		if (git_host_wait(git_host_spawn(git_host_execpath("git"), unbundleargv, -1, devnull, -1)) != 0) {
+			errx(EXIT_FAILURE, "Unable to thaw '%s'", path);
+		}
+
+		close(devnull);
+		unlinkat(stagingfd, GIT_HOST_HIBERNATION_BUNDLE, 0);
+		free(gitdirarg);
+		free(bundlepath);
+	}
+
+	if (reftable) {
+		git_host_tree_remove(stagingfd, "reftable");
+	}
+
+	if ((reftable && renameat(stagingfd, GIT_HOST_HIBERNATION_HELD"reftable", stagingfd, "reftable") != 0)
+		|| (renameat(stagingfd, GIT_HOST_HIBERNATION_HELD"packed-refs", stagingfd, "packed-refs") != 0 && errno != ENOENT)) {
+		err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+	}
+	close(stagingfd);
+
+	/* Once exchanged, the staging name holds the archive, which waiting sessions will find replaced */
+	if (renameat2(AT_FDCWD, staging, AT_FDCWD, repository, RENAME_EXCHANGE) != 0) {
+		err(EXIT_FAILURE, "Unable to thaw '%s'", path);
+	}
+	unlink(staging);
+	close(fd);
+	free(staging);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	git_host_hibernation_record((end.tv_sec - start.tv_sec) * 1000000ull + end.tv_nsec / 1000 - start.tv_nsec / 1000);
+
+	return 1;
+}
+
+static char *
+git_host_repository_path(const char *raw, enum git_host_mode mode) {
+	char path[strlen(raw) + 1];
+
+	memcpy(path, raw, sizeof (path));
+	const int invalid = git_host_normalize_path(path) != 0 || git_host_check_repository_path(path, mode) != 0;
+	GIT_HOST_PROBE(git_host, path, raw, (const char *)path, mode, invalid);
+
+	if (invalid) {
+		errx(EXIT_FAILURE, "Invalid repository path '%s' '%s'", path, raw);
+	}
+
+	return git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path);
+}
+
+static char *
+git_host_repository(const char *raw, enum git_host_mode mode) {
+	char * const repository = git_host_repository_path(raw, mode);
+	const char * const path = repository + sizeof (CONFIG_GIT_HOME_REPOSITORIES);
+
+	/* Both fail silently for repositories which don't exist yet */
+	git_host_thaw(repository, path);
+	git_host_access_stamp(repository);
+
+	return repository;
+}
+
+static int
+git_host_dir_filter(const struct dirent *entry) {
+	return *entry->d_name != '.';
+}
+
+static void
+git_host_dir(int dirfd, const char *directory) {
+	struct dirent **namelist;
+	int count;
+
+	count = scandirat(dirfd, directory, &namelist, git_host_dir_filter, alphasort);
+	if (count < 0) {
+		err(EXIT_FAILURE, "scandir %s", directory);
+	}
+
+	const char * const authorized = getenv("SSH_AUTHORIZED_BY");
+
+	printf("%s:\n", directory);
+	for (int i = 0; i < count; i++) {
+		struct dirent * const entry = namelist[i];
+		char * const path = git_host_pathcat(directory, entry->d_name);
+
+		if (git_host_acl_mode(authorized, path) & GIT_HOST_MODE_RO) {
+			printf("\t%s\n", path);
+		}
+
+		free(path);
+
+		free(entry);
+	}
+
+	free(namelist);
+}
+
+static void noreturn
+git_host_exec_dir(int argc, char **argv) {
+	/* Stay in the home directory, access-control lookups are relative to it */
+	const int dirfd = open(CONFIG_GIT_HOME_REPOSITORIES, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dirfd < 0) {
+		err(EXIT_FAILURE, "open "CONFIG_GIT_HOME_REPOSITORIES);
+	}
+
+	if (argc == 1) {
+		DIR * const dirp = fdopendir(dup(dirfd));
+		struct dirent *entry;
+
+		if (dirp == NULL) {
+			err(EXIT_FAILURE, "fdopendir "CONFIG_GIT_HOME_REPOSITORIES);
+		}
+
+		while (errno = 0, entry = readdir(dirp)) {
+			if (*entry->d_name != '.') {
+				git_host_dir(dirfd, entry->d_name);
+			}
+		}
+
+		closedir(dirp);
+	} else {
+		for (int i = 1; i < argc; i++) {
+			/* Only owners are listed, so that access is always checked on the <owner>/<repo> paths listed */
+			char owner[strlen(argv[i]) + 1];
+
+			memcpy(owner, argv[i], sizeof (owner));
+			if (git_host_normalize_path(owner) != 0 || *owner == '.' || strchr(owner, '/') != NULL) {
+				errx(EXIT_FAILURE, "Invalid owner '%s'", argv[i]);
+			}
+
+			git_host_dir(dirfd, owner);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Ref-update journal, segments named after their first sequence number and filled through shared mappings */
+#define GIT_HOST_JOURNAL_MAGIC "GHJRNL\0\1"
+#define GIT_HOST_JOURNAL_SEALED UINT64_MAX
+
+struct git_host_journal_header {
+	char magic[8];
+	uint64_t first;
+	uint64_t next;
+	uint64_t tail;
+};
+
+struct git_host_journal_record {
+	uint64_t sequence; /* Written last, zero until the record is complete */
+	uint32_t length;
+	uint32_t reserved;
+	/* char payload[length], padded to 8 bytes */
+};
+
+struct git_host_journal_segment {
+	int fd;
+	struct git_host_journal_header *header;
+};
+
+static int
+git_host_journal_filter(const struct dirent *entry) {
+	const size_t length = strlen(entry->d_name);
+
+	return length == 16 + sizeof (".journal") - 1 && strcmp(entry->d_name + 16, ".journal") == 0;
+}
+
+static int
+git_host_journal_segments(struct dirent ***namelistp) {
+	/* Zero padded hexadecimal names, so alphabetical order is sequence order */
+	const int count = scandir(CONFIG_GIT_HOME_JOURNAL, namelistp, git_host_journal_filter, alphasort);
+
+	if (count < 0) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "scandir "CONFIG_GIT_HOME_JOURNAL);
+		}
+		*namelistp = NULL;
+		return 0;
+	}
+
+	return count;
+}
+
+static int
+git_host_journal_segment_open(const char *name, int flags, struct git_host_journal_segment *segment) {
+	char * const path = git_host_pathcat(CONFIG_GIT_HOME_JOURNAL, name);
+	const int prot = (flags & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+	struct stat st;
+
+	segment->fd = open(path, flags | O_CLOEXEC, 0644);
+	free(path);
+
+	if (segment->fd < 0) {
+		return -1;
+	}
+
+	if (flags & O_CREAT) {
+		if (ftruncate(segment->fd, CONFIG_GIT_JOURNAL_SEGMENT_SIZE) != 0) {
+			err(EXIT_FAILURE, "ftruncate %s", name);
+		}
+	}
+
+	if (fstat(segment->fd, &st) != 0 || st.st_size != CONFIG_GIT_JOURNAL_SEGMENT_SIZE
+		|| (segment->header = mmap(NULL, st.st_size, prot, MAP_SHARED, segment->fd, 0)) == MAP_FAILED) {
+		errx(EXIT_FAILURE, "Invalid journal segment %s", name);
+	}
+
+	return 0;
+}
+
+static void
+git_host_journal_segment_close(struct git_host_journal_segment *segment) {
+	munmap(segment->header, CONFIG_GIT_JOURNAL_SEGMENT_SIZE);
+	close(segment->fd);
+}
+
+static void
+git_host_journal_segment_create(uint64_t first, struct git_host_journal_segment *segment) {
+	char name[32];
+
+	snprintf(name, sizeof (name), "%016llx.journal", (unsigned long long)first);
+	if (git_host_journal_segment_open(name, O_RDWR | O_CREAT | O_EXCL, segment) != 0) {
+		err(EXIT_FAILURE, "Unable to create journal segment %s", name);
+	}
+
+	memcpy(segment->header->magic, GIT_HOST_JOURNAL_MAGIC, sizeof (segment->header->magic));
+	segment->header->first = first;
+	segment->header->next = first;
+	segment->header->tail = sizeof (*segment->header);
+}
+
+static void
+git_host_journal_append(char * const *payloads, int count) {
+	/* Writers serialize on the lock file, readers never lock and only trust completed sequence numbers */
+	struct git_host_journal_segment segment;
+	struct dirent **namelist;
+
+	if (count == 0) {
+		return;
+	}
+
+	mkdir(CONFIG_GIT_HOME_JOURNAL, 0777);
+
+	const int lockfd = open(CONFIG_GIT_HOME_JOURNAL"/lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lockfd < 0) {
+		err(EXIT_FAILURE, "open "CONFIG_GIT_HOME_JOURNAL"/lock");
+	}
+
+	while (flock(lockfd, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "flock");
+		}
+	}
+
+	const int listed = git_host_journal_segments(&namelist);
+	int segments = listed;
+
+	if (segments == 0) {
+		git_host_journal_segment_create(1, &segment);
+		segments++;
+	} else if (git_host_journal_segment_open(namelist[segments - 1]->d_name, O_RDWR, &segment) != 0) {
+		err(EXIT_FAILURE, "Unable to open journal segment %s", namelist[segments - 1]->d_name);
+	}
+
+	for (int i = 0; i < count; i++) {
+		const size_t length = strlen(payloads[i]);
+		const size_t size = sizeof (struct git_host_journal_record) + (length + 7) / 8 * 8;
+
+		/* Always leave room for the seal record */
+		if (segment.header->tail + size + sizeof (struct git_host_journal_record) > CONFIG_GIT_JOURNAL_SEGMENT_SIZE) {
+			struct git_host_journal_record * const seal = (void *)((char *)segment.header + segment.header->tail);
+			const uint64_t next = segment.header->next;
+
+			if (size + sizeof (*segment.header) + sizeof (*seal) > CONFIG_GIT_JOURNAL_SEGMENT_SIZE) {
+				errx(EXIT_FAILURE, "Journal record too big for a segment");
+			}
+
+			__atomic_store_n(&seal->sequence, GIT_HOST_JOURNAL_SEALED, __ATOMIC_RELEASE);
+			git_host_journal_segment_close(&segment);
+			git_host_journal_segment_create(next, &segment);
+			segments++;
+		}
+
+		struct git_host_journal_record * const record = (void *)((char *)segment.header + segment.header->tail);
+		record->length = length;
+		memcpy(record + 1, payloads[i], length);
+		__atomic_store_n(&record->sequence, segment.header->next, __ATOMIC_RELEASE);
+
+		segment.header->next++;
+		segment.header->tail += size;
+	}
+
+	/* Stores through the mapping are invisible to inotify, touch the segment to wake up watchers */
+	futimens(segment.fd, NULL);
+	git_host_journal_segment_close(&segment);
+
+	/* Retention, oldest segments go first */
+	for (int i = 0; i < listed; i++) {
+		if (i < segments - CONFIG_GIT_JOURNAL_SEGMENTS) {
+			char * const path = git_host_pathcat(CONFIG_GIT_HOME_JOURNAL, namelist[i]->d_name);
+
+			unlink(path);
+			free(path);
+		}
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	close(lockfd);
+}
+
+static uint64_t
+git_host_journal_read(uint64_t since, int (*callback)(uint64_t, const char *, size_t, void *), void *data) {
+	/* Calls back with every record from sequence since, until the callback returns non-zero, returns the next sequence */
+	struct dirent **namelist;
+	const int segments = git_host_journal_segments(&namelist);
+	uint64_t next = since;
+
+	for (int i = 0; i < segments; i++) {
+		struct git_host_journal_segment segment;
+
+		/* Skip segments entirely before since, their successor starts at or before it */
+		if (i + 1 < segments && strtoull(namelist[i + 1]->d_name, NULL, 16) <= since) {
+			continue;
+		}
+
+		if (git_host_journal_segment_open(namelist[i]->d_name, O_RDONLY, &segment) != 0) {
+			continue; /* Removed by retention since listed */
+		}
+
+		size_t offset = sizeof (*segment.header);
+		while (offset + sizeof (struct git_host_journal_record) <= CONFIG_GIT_JOURNAL_SEGMENT_SIZE) {
+			const struct git_host_journal_record * const record = (const void *)((const char *)segment.header + offset);
+			const uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+
+			if (sequence == 0 || sequence == GIT_HOST_JOURNAL_SEALED
+				|| offset + sizeof (*record) + record->length > CONFIG_GIT_JOURNAL_SEGMENT_SIZE) {
+				break;
+			}
+
+			if (sequence >= since) {
+				next = sequence + 1;
+				if (callback(sequence, (const char *)(record + 1), record->length, data) != 0) {
+					git_host_journal_segment_close(&segment);
+					goto end;
+				}
+			}
+
+			offset += sizeof (*record) + (record->length + 7) / 8 * 8;
+		}
+
+		git_host_journal_segment_close(&segment);
+	}
+
+end:
+	for (int i = 0; i < segments; i++) {
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	return next;
+}
+
+static uint64_t
+git_host_journal_next(void) {
+	/* Sequence number of the next record to be written */
+	struct git_host_journal_segment segment;
+	struct dirent **namelist;
+	const int segments = git_host_journal_segments(&namelist);
+	uint64_t next = 1;
+
+	if (segments != 0 && git_host_journal_segment_open(namelist[segments - 1]->d_name, O_RDONLY, &segment) == 0) {
+		next = __atomic_load_n(&segment.header->next, __ATOMIC_ACQUIRE);
+		git_host_journal_segment_close(&segment);
+	}
+
+	for (int i = 0; i < segments; i++) {
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	return next;
+}
+
+static void
+git_host_install_hooks(const char *repository) {
+	/* Hooks are symbolic links to git-host itself, which dispatches on its program name */
+	static const char * const hooks[] = { "post-receive", "pre-receive" };
+	char self[PATH_MAX];
+	const ssize_t length = readlink("/proc/self/exe", self, sizeof (self) - 1);
+
+	if (length < 0) {
+		err(EXIT_FAILURE, "readlink /proc/self/exe");
+	}
+	self[length] = '\0';
+
+	char * const hooksdir = git_host_pathcat(repository, "hooks");
+	mkdir(hooksdir, 0777);
+
+	for (unsigned int i = 0; i < sizeof (hooks) / sizeof (*hooks); i++) {
+		char * const hook = git_host_pathcat(hooksdir, hooks[i]);
+
+		/* Never replace a hook from the templates or the administrator */
+		if (symlink(self, hook) != 0 && errno != EEXIST) {
+			warn("symlink %s", hook);
+		}
+
+		free(hook);
+	}
+
+	free(hooksdir);
+}
+
+struct git_host_waiter {
+	const char *path;
+	const char *prefix;
+	int matches;
+};
+
+static int
+git_host_waiter_match(uint64_t sequence, const char *payload, size_t length, void *data) {
+	struct git_host_waiter * const waiter = data;
+	char record[length + 1], *saveptr;
+
+	memcpy(record, payload, length);
+	record[length] = '\0';
+
+	const char * const path = strtok_r(record, " ", &saveptr);
+	const char * const ref = strtok_r(NULL, " ", &saveptr);
+	const char * const old = strtok_r(NULL, " ", &saveptr);
+	const char * const new = strtok_r(NULL, " ", &saveptr);
+
+	if (new != NULL && strcmp(path, waiter->path) == 0
+		&& strncmp(ref, waiter->prefix, strlen(waiter->prefix)) == 0) {
+		printf("%llu %s %s %s\n", (unsigned long long)sequence, ref, old, new);
+		waiter->matches++;
+	}
+
+	return 0;
+}
+
+static void noreturn
+git_host_exec_wait(int argc, char **argv) {
+	struct git_host_waiter waiter = { .prefix = "", .matches = 0 };
+	const char *raw = NULL;
+	uint64_t since = 0;
+	long timeout = -1;
+	char *end;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+			since = strtoull(argv[++i], &end, 10);
+			if (*argv[i] == '\0' || *end != '\0' || since == 0) {
+				errx(EXIT_FAILURE, "Invalid sequence '%s'", argv[i]);
+			}
+		} else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+			timeout = strtol(argv[++i], &end, 10);
+			if (*argv[i] == '\0' || *end != '\0' || timeout < 0 || timeout > INT_MAX / 1000) {
+				errx(EXIT_FAILURE, "Invalid timeout '%s'", argv[i]);
+			}
+			timeout *= 1000;
+		} else if (*argv[i] == '-') {
+			raw = NULL;
+			break;
+		} else if (raw == NULL) {
+			raw = argv[i];
+		} else if (*waiter.prefix == '\0') {
+			waiter.prefix = argv[i];
+		} else {
+			raw = NULL;
+			break;
+		}
+	}
+
+	if (raw == NULL) {
+		fprintf(stderr, "usage: %s <repository> [<ref-prefix>] [--since <sequence>] [--timeout <seconds>]\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	waiter.path = git_host_repository(raw, GIT_HOST_MODE_RO) + sizeof (CONFIG_GIT_HOME_REPOSITORIES);
+
+	/* Watch before reading, so a push landing in between still wakes us up */
+	mkdir(CONFIG_GIT_HOME_JOURNAL, 0777);
+
+	const int inotifyfd = inotify_init1(IN_CLOEXEC);
+	if (inotifyfd < 0 || inotify_add_watch(inotifyfd, CONFIG_GIT_HOME_JOURNAL, IN_ATTRIB | IN_CREATE) < 0) {
+		err(EXIT_FAILURE, "inotify "CONFIG_GIT_HOME_JOURNAL);
+	}
+
+	if (since == 0) {
+		since = git_host_journal_next();
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+
+	while (since = git_host_journal_read(since, git_host_waiter_match, &waiter), waiter.matches == 0) {
+		/* The client hanging up, an error on output, also ends the wait */
+		struct pollfd fds[] = {
+			{ .fd = inotifyfd, .events = POLLIN },
+			{ .fd = STDOUT_FILENO, .events = 0 },
+		};
+		int remaining = -1;
+
+		if (timeout >= 0) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if (remaining <= 0) {
+				errx(EXIT_FAILURE, "Timed out waiting for '%s'", waiter.path);
+			}
+		}
+
+		if (poll(fds, 2, remaining) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		if (fds[1].revents != 0) {
+			exit(EXIT_FAILURE);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+			if (read(inotifyfd, events, sizeof (events)) < 0 && errno != EINTR) {
+				err(EXIT_FAILURE, "read inotify");
+			}
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static char *
+git_host_pattern_match(const char *file, const char *path) {
+	/* Lines of a pattern file are `<pattern> <value>`, returns the value of the first pattern matching <owner>/<repo> */
+	FILE * const filep = fopen(file, "r");
+	char *line = NULL, *value = NULL;
+	size_t n = 0;
+
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "fopen %s", file);
+		}
+		return NULL;
+	}
+
+	while (value == NULL && getline(&line, &n, filep) >= 0) {
+		char *saveptr;
+
+		line[strcspn(line, "#")] = '\0';
+
+		const char * const linepattern = strtok_r(line, " \t\n", &saveptr);
+		const char * const linevalue = strtok_r(NULL, " \t\n", &saveptr);
+
+		if (linepattern != NULL && linevalue != NULL && fnmatch(linepattern, path, FNM_PATHNAME) == 0) {
+			value = xstrdup(linevalue);
+		}
+	}
+
+	free(line);
+	fclose(filep);
+
+	return value;
+}
+
+static char *
+git_host_ref_format(const char *path) {
+	char * const format = git_host_pattern_match(CONFIG_GIT_HOME_REF_FORMAT, path);
+
+	if (format == NULL) {
+		return xstrdup(CONFIG_GIT_REF_FORMAT);
+	}
+
+	if (strcmp(format, "files") != 0 && strcmp(format, "reftable") != 0) {
+		errx(EXIT_FAILURE, CONFIG_GIT_HOME_REF_FORMAT": Invalid ref format '%s' for '%s'", format, path);
+	}
+
+	return format;
+}
+
+/* Settings every profile shares, see git_host_profile() */
+#define GIT_HOST_PROFILE_BASE \
+	{ "core.commitGraph",       "true",      "bool" }, \
+	{ "gc.writeCommitGraph",    "true",      "bool" }, \
+	{ "fetch.writeCommitGraph", "true",      "bool" }, \
+	{ "pack.useSparse",         "true",      "bool" }, \
+	{ "core.fsync",             "committed", NULL }, \
+	{ "core.fsyncMethod",       "batch",     NULL }
+
+struct git_host_profile_setting {
+	const char *key;
+	const char *value;
+	const char *type; /* As understood by git config --type, NULL if compared literally */
+};
+
+static const struct git_host_profile_setting *
+git_host_profile(const char *name) {
+	/* Settings of a performance profile, NULL terminated, or NULL if there is no such profile */
+	static const struct git_host_profile_setting small[] = {
+		GIT_HOST_PROFILE_BASE,
+		{ NULL, NULL, NULL },
+	};
+	static const struct git_host_profile_setting monorepo[] = {
+		GIT_HOST_PROFILE_BASE,
+		{ "repack.writeBitmaps",          "true",   "bool" },
+		{ "pack.writeBitmapHashCache",    "true",   "bool" },
+		{ "pack.writeBitmapLookupTable",  "true",   "bool" },
+		{ "core.multiPackIndex",          "true",   "bool" },
+		{ "uploadpack.allowFilter",       "true",   "bool" },
+		{ "core.bigFileThreshold",        "64m",    "int" },
+		{ NULL, NULL, NULL },
+	};
+	static const struct git_host_profile_setting ciheavy[] = {
+		GIT_HOST_PROFILE_BASE,
+		{ "repack.writeBitmaps",          "true",   "bool" },
+		{ "pack.writeBitmapHashCache",    "true",   "bool" },
+		{ "pack.useBitmaps",              "true",   "bool" },
+		{ "uploadpack.allowFilter",       "true",   "bool" },
+		{ NULL, NULL, NULL },
+	};
+	static const struct git_host_profile_setting archive[] = {
+		GIT_HOST_PROFILE_BASE,
+		{ "core.compression",             "9",      "int" },
+		{ "pack.compression",             "9",      "int" },
+		{ "gc.auto",                      "0",      "int" },
+		{ "receive.autogc",               "false",  "bool" },
+		{ NULL, NULL, NULL },
+	};
+	static const struct {
+		const char * const name;
+		const struct git_host_profile_setting * const settings;
+	} profiles[] = {
+		{ "archive",  archive },
+		{ "ci-heavy", ciheavy },
+		{ "monorepo", monorepo },
+		{ "small",    small },
+	};
+	const unsigned int profilescount = sizeof (profiles) / sizeof (*profiles);
+	unsigned int i = 0;
+
+	while (i < profilescount && strcmp(name, profiles[i].name) != 0) {
+		i++;
+	}
+
+	return i < profilescount ? profiles[i].settings : NULL;
+}
+
+static char *
+git_host_profile_name(const char *path) {
+	char * const name = git_host_pattern_match(CONFIG_GIT_HOME_PROFILES, path);
+
+	if (name == NULL) {
+		return xstrdup(CONFIG_GIT_PROFILE);
+	}
+
+	if (git_host_profile(name) == NULL) {
+		errx(EXIT_FAILURE, CONFIG_GIT_HOME_PROFILES": Invalid profile '%s' for '%s'", name, path);
+	}
+
+	return name;
+}
+
+static int
+git_host_profile_set(const char *repository, const char *key, const char *value) {
+	char * const config = git_host_pathcat(repository, "config");
+	char * const configargv[] = { "git", "config", "--file", config, (char *)key, (char *)value, NULL };
+	const int status = git_host_wait(git_host_spawn(git_host_execpath("git"), configargv, -1, -1, -1));
+
+	free(config);
+
+	return status == 0 ? 0 : -1;
+}
+
+static void noreturn
+git_host_exec_init(int argc, char **argv) {
+	static const char argv0[] = "git-init";
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <repository>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	char * const repository = git_host_repository(argv[1], GIT_HOST_MODE_WR);
+	char * const format = git_host_ref_format(repository + sizeof (CONFIG_GIT_HOME_REPOSITORIES));
+	char *initargv[7] = { (char *)argv0, "--quiet", "--bare" };
+	int initargc = 3;
+
+	/* The default backend is left implicit, older git(1) don't know the option */
+	if (strcmp(format, "files") != 0 && asprintf(&initargv[initargc++], "--ref-format=%s", format) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	initargv[initargc++] = "--";
+	initargv[initargc++] = repository;
+
+	const int status = git_host_wait(git_host_spawn(git_host_execpath(argv0), initargv, -1, -1, -1));
+
+	if (status != 0) {
+		exit(status < 0 ? EXIT_FAILURE : status);
+	}
+
+	git_host_install_hooks(repository);
+
+	char * const profile = git_host_profile_name(repository + sizeof (CONFIG_GIT_HOME_REPOSITORIES));
+	for (const struct git_host_profile_setting *setting = git_host_profile(profile); setting->key != NULL; setting++) {
+		if (git_host_profile_set(repository, setting->key, setting->value) != 0) {
+			errx(EXIT_FAILURE, "Unable to apply profile '%s'", profile);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Per-repository push queue, see git_host_queue() */
+#define GIT_HOST_QUEUE "git-host-queue"
+
+static volatile sig_atomic_t git_host_queue_timedout;
+
+static void
+git_host_queue_alarm(int signo) {
+	git_host_queue_timedout = 1;
+}
+
+static int
+git_host_queue_filter(const struct dirent *entry) {
+	return *entry->d_name >= '0' && *entry->d_name <= '9';
+}
+
+static int
+git_host_queue_node(int dirfd, uint64_t ticket, int flags) {
+	char name[24];
+
+	snprintf(name, sizeof (name), "%llu", (unsigned long long)ticket);
+
+	return openat(dirfd, name, O_RDWR | O_CLOEXEC | flags, 0644);
+}
+
+static void
+git_host_queue_remove(int dirfd, uint64_t ticket) {
+	char name[24];
+
+	snprintf(name, sizeof (name), "%llu", (unsigned long long)ticket);
+
+	if (unlinkat(dirfd, name, 0) != 0) {
+		warn("unlink %s", name);
+	}
+}
+
+static int
+git_host_queue(const char *repository, const char *path) {
+	/*
+	 * Pushes to a repository take tickets, and each waits for the node of its predecessor
+	 * to be unlocked, as in a CLH queue lock. A node holds the ticket its owner waits for,
+	 * and is emptied once its owner reaches the head of the queue. A node left non-empty,
+	 * by an owner which timed out or died, redirects its successor to its own predecessor.
+	 * Nodes are removed by their successor, the last one is left for the next push.
+	 * Returns the locked node to keep open until the push is over, or -1 if disabled.
+	 */
+	if (CONFIG_GIT_PUSH_QUEUE_TIMEOUT == 0) {
+		return -1;
+	}
+
+	char * const queue = git_host_pathcat(repository, GIT_HOST_QUEUE);
+	mkdir(queue, 0777);
+
+	const int dirfd = open(queue, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		err(EXIT_FAILURE, "open %s", queue);
+	}
+
+	const int tailfd = openat(dirfd, "tail", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (tailfd < 0) {
+		err(EXIT_FAILURE, "open %s/tail", queue);
+	}
+
+	while (flock(tailfd, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "flock");
+		}
+	}
+
+	uint64_t predecessor = 0;
+	if (pread(tailfd, &predecessor, sizeof (predecessor), 0) < 0) {
+		err(EXIT_FAILURE, "read %s/tail", queue);
+	}
+
+	/* The node is locked before being published, its successor can only wait for it */
+	const uint64_t ticket = predecessor + 1;
+	const int nodefd = git_host_queue_node(dirfd, ticket, O_CREAT | O_TRUNC);
+	if (nodefd < 0 || flock(nodefd, LOCK_EX | LOCK_NB) != 0
+		|| pwrite(nodefd, &predecessor, sizeof (predecessor), 0) != sizeof (predecessor)
+		|| pwrite(tailfd, &ticket, sizeof (ticket), 0) != sizeof (ticket)) {
+		err(EXIT_FAILURE, "Unable to queue in %s", queue);
+	}
+	close(tailfd);
+
+	const struct sigaction action = { .sa_handler = git_host_queue_alarm };
+	if (sigaction(SIGALRM, &action, NULL) != 0) {
+		err(EXIT_FAILURE, "sigaction");
+	}
+	alarm(CONFIG_GIT_PUSH_QUEUE_TIMEOUT);
+
+	int predecessorfd, waited = 0;
+	while (predecessorfd = git_host_queue_node(dirfd, predecessor, 0), predecessorfd >= 0) {
+		if (flock(predecessorfd, LOCK_EX | LOCK_NB) != 0) {
+			if (errno != EWOULDBLOCK) {
+				err(EXIT_FAILURE, "flock");
+			}
+
+			if (!waited) {
+				struct dirent **namelist;
+				const int count = scandirat(dirfd, ".", &namelist, git_host_queue_filter, NULL);
+
+				for (int i = 0; i < count; i++) {
+					free(namelist[i]);
+				}
+				if (count >= 0) {
+					free(namelist);
+				}
+
+				warnx("%d push(es) to '%s' ahead in the queue, waiting...", count - 1, path);
+				waited = 1;
+			}
+
+			while (flock(predecessorfd, LOCK_EX) != 0) {
+				if (errno != EINTR) {
+					err(EXIT_FAILURE, "flock");
+				}
+
+				if (git_host_queue_timedout) {
+					errx(EXIT_FAILURE, "Timed out waiting for earlier pushes to '%s'", path);
+				}
+			}
+		}
+
+		const uint64_t done = predecessor;
+		const ssize_t readed = pread(predecessorfd, &predecessor, sizeof (predecessor), 0);
+
+		git_host_queue_remove(dirfd, done);
+		close(predecessorfd);
+
+		if (readed != sizeof (predecessor)) {
+			break;
+		}
+
+		/* The predecessor gave up, take over its wait */
+		if (pwrite(nodefd, &predecessor, sizeof (predecessor), 0) != sizeof (predecessor)) {
+			err(EXIT_FAILURE, "Unable to queue in %s", queue);
+		}
+	}
+
+	if (predecessorfd < 0 && errno != ENOENT) {
+		err(EXIT_FAILURE, "open %s", queue);
+	}
+	alarm(0);
+
+	if (ftruncate(nodefd, 0) != 0) {
+		err(EXIT_FAILURE, "ftruncate %s", queue);
+	}
+
+	close(dirfd);
+	free(queue);
+
+	return nodefd;
+}
+
+static void
+git_host_repository_moved(const char *path, const char *renamed, char **refs, int count) {
+	/*
+	 * Follows a repository deleted, or renamed, with its usage counter, and journals it as the deletion of its refs,
+	 * and their creation under its new name, so that followers of the journal such as replication learn about it.
+	 * Without refs, or when they can't be listed as in hibernated repositories, a no-op update of HEAD stands for them.
+	 */
+	const char * const user = getenv("SSH_AUTHORIZED_BY") != NULL ? getenv("SSH_AUTHORIZED_BY") : "-";
+	const long long now = time(NULL);
+	char * const counter = git_host_pathcat(CONFIG_GIT_HOME_USAGE, path);
+	char **payloads = NULL, *payload;
+	int payloadscount = 0;
+
+	if (renamed != NULL) {
+		char * const moved = git_host_pathcat(CONFIG_GIT_HOME_USAGE, renamed);
+		char * const ownerdir = xstrdup(moved);
+
+		*strrchr(ownerdir, '/') = '\0';
+		mkdir(ownerdir, 0777);
+
+		if (rename(counter, moved) != 0 && errno != ENOENT) {
+			warn("Unable to rename usage counter of '%s'", path);
+		}
+
+		free(ownerdir);
+		free(moved);
+	} else if (unlink(counter) != 0 && errno != ENOENT) {
+		warn("Unable to remove usage counter of '%s'", path);
+	}
+	free(counter);
+
+	for (int i = 0; i < (count > 0 ? count : 1); i++) {
+		const char * const ref = count > 0 ? strchr(refs[i], ' ') + 1 : "HEAD";
+		const int oidlen = count > 0 ? ref - refs[i] - 1 : 40;
+		const char * const oid = count > 0 ? refs[i] : "0000000000000000000000000000000000000000";
+		char zero[oidlen + 1];
+
+		memset(zero, '0', oidlen);
+		zero[oidlen] = '\0';
+
+		if (asprintf(&payload, "%s %s %.*s %s %s %lld", path, ref, oidlen, oid, zero, user, now) < 0) {
+			err(EXIT_FAILURE, "asprintf");
+		}
+		git_host_array_push(payload, &payloadscount, &payloads);
+
+		if (renamed != NULL) {
+			if (asprintf(&payload, "%s %s %s %.*s %s %lld", renamed, ref, zero, oidlen, oid, user, now) < 0) {
+				err(EXIT_FAILURE, "asprintf");
+			}
+			git_host_array_push(payload, &payloadscount, &payloads);
+		}
+	}
+
+	git_host_journal_append(payloads, payloadscount);
+
+	for (int i = 0; i < payloadscount; i++) {
+		free(payloads[i]);
+	}
+	free(payloads);
+}
+
+static void noreturn
+git_host_exec_delete(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <repository>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Moved to the trash as is, hibernated or not, its space is reclaimed later by git-host -m reap */
+	char * const repository = git_host_repository_path(argv[1], GIT_HOST_MODE_WR);
+	const char * const path = repository + sizeof (CONFIG_GIT_HOME_REPOSITORIES);
+	const char * const repo = strchr(path, '/') + 1;
+	const size_t length = sizeof (GIT_HOST_TRASH) + strlen(path) + 32;
+	char trashed[length], **refs;
+	struct stat st;
+
+	snprintf(trashed, length, GIT_HOST_TRASH"/%.*s.%s.%lld-%d",
+		(int)(repo - path - 1), path, repo, (long long)time(NULL), (int)getpid());
+	mkdir(GIT_HOST_TRASH, 0777);
+
+	/* Behind the pushes in flight, so the refs journaled as deleted are the ones moved to the trash */
+	const int queue = stat(repository, &st) == 0 && S_ISDIR(st.st_mode) ? git_host_queue(repository, path) : -1;
+	const int count = stat(repository, &st) == 0 && S_ISDIR(st.st_mode) ? git_host_refs(repository, &refs) : -1;
+
+	if (renameat2(AT_FDCWD, repository, AT_FDCWD, trashed, RENAME_NOREPLACE) != 0) {
+		err(EXIT_FAILURE, "Unable to delete '%s'", path);
+	}
+
+	git_host_repository_moved(path, NULL, refs, count);
+	close(queue);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void noreturn
+git_host_exec_rename(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <repository> <new repository>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	char * const repository = git_host_repository_path(argv[1], GIT_HOST_MODE_WR);
+	char * const renamed = git_host_repository_path(argv[2], GIT_HOST_MODE_WR);
+	const char * const path = repository + sizeof (CONFIG_GIT_HOME_REPOSITORIES);
+	char * const ownerdir = xstrdup(renamed);
+	struct stat st;
+	char **refs;
+
+	if (stat(repository, &st) != 0) {
+		err(EXIT_FAILURE, "Unable to rename '%s' to '%s'", path, renamed + sizeof (CONFIG_GIT_HOME_REPOSITORIES));
+	}
+
+	/* Behind the pushes in flight, so the refs journaled as recreated are the ones renamed */
+	const int queue = S_ISDIR(st.st_mode) ? git_host_queue(repository, path) : -1;
+	const int count = stat(repository, &st) == 0 && S_ISDIR(st.st_mode) ? git_host_refs(repository, &refs) : -1;
+
+	*strrchr(ownerdir, '/') = '\0';
+	const int created = mkdir(ownerdir, 0777) == 0;
+
+	if (renameat2(AT_FDCWD, repository, AT_FDCWD, renamed, RENAME_NOREPLACE) != 0) {
+		const int error = errno;
+
+		/* Not leaving behind an owner created for nothing */
+		if (created) {
+			rmdir(ownerdir);
+		}
+		errno = error;
+		err(EXIT_FAILURE, "Unable to rename '%s' to '%s'", path, renamed + sizeof (CONFIG_GIT_HOME_REPOSITORIES));
+	}
+
+	git_host_repository_moved(path, renamed + sizeof (CONFIG_GIT_HOME_REPOSITORIES), refs, count);
+	close(queue);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+git_host_config_push(const char *key, const char *value) {
+	/* Per-session git configuration, through the environment so it reaches every git child */
+	const char * const countstr = getenv("GIT_CONFIG_COUNT");
+	const unsigned long count = countstr != NULL ? strtoul(countstr, NULL, 10) : 0;
+	char name[32], number[24];
+
+	snprintf(name, sizeof (name), "GIT_CONFIG_KEY_%lu", count);
+	setenv(name, key, 1);
+	snprintf(name, sizeof (name), "GIT_CONFIG_VALUE_%lu", count);
+	setenv(name, value, 1);
+	snprintf(number, sizeof (number), "%lu", count + 1);
+	setenv("GIT_CONFIG_COUNT", number, 1);
+}
+
+static int
+git_host_parse_size(const char *string, unsigned long long *sizep) {
+	static const char suffixes[] = "KMGT";
+	char *end;
+
+	errno = 0;
+	unsigned long long size = strtoull(string, &end, 10);
+	if (errno != 0 || end == string) {
+		return -1;
+	}
+
+	if (*end != '\0') {
+		const char * const suffix = strchr(suffixes, *end);
+
+		if (suffix == NULL || end[1] != '\0') {
+			return -1;
+		}
+
+		for (const char *it = suffixes; it <= suffix; it++) {
+			if (size > ULLONG_MAX / 1024) {
+				return -1;
+			}
+			size *= 1024;
+		}
+	}
+
+	*sizep = size;
+	return 0;
+}
+
+static unsigned long long
+git_host_quota_limit(const char *kind, const char *name, unsigned long long limit) {
+	/* Lines of the quota file are `user <name> <size>` or `repository <owner>/<repo> <size>`, zero is unlimited */
+	FILE * const filep = fopen(CONFIG_GIT_HOME_QUOTA, "r");
+	char *line = NULL;
+	size_t n = 0;
+
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "fopen "CONFIG_GIT_HOME_QUOTA);
+		}
+		return limit;
+	}
+
+	while (getline(&line, &n, filep) >= 0) {
+		char *saveptr;
+
+		line[strcspn(line, "#")] = '\0';
+
+		const char * const linekind = strtok_r(line, " \t\n", &saveptr);
+		const char * const linename = strtok_r(NULL, " \t\n", &saveptr);
+		const char * const linesize = strtok_r(NULL, " \t\n", &saveptr);
+
+		if (linekind != NULL && linename != NULL && linesize != NULL
+			&& strcmp(linekind, kind) == 0 && strcmp(linename, name) == 0) {
+			if (git_host_parse_size(linesize, &limit) != 0) {
+				errx(EXIT_FAILURE, CONFIG_GIT_HOME_QUOTA": Invalid size '%s' for %s %s", linesize, kind, name);
+			}
+		}
+	}
+
+	free(line);
+	fclose(filep);
+
+	return limit;
+}
+
+static unsigned long long
+git_host_directory_size(int dirfd, const char *path) {
+	/* Sums regular files of a single directory, without recursing */
+	const int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	unsigned long long size = 0;
+	struct dirent *entry;
+	DIR *dirp;
+
+	if (fd < 0 || (dirp = fdopendir(fd)) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	while (entry = readdir(dirp), entry != NULL) {
+		struct stat st;
+
+		if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+			size += st.st_size;
+		}
+	}
+
+	closedir(dirp);
+
+	return size;
+}
+
+static unsigned long long
+git_host_usage_read(int fd) {
+	char buffer[32];
+	const ssize_t readed = pread(fd, buffer, sizeof (buffer) - 1, 0);
+
+	if (readed <= 0) {
+		return 0;
+	}
+	buffer[readed] = '\0';
+
+	return strtoull(buffer, NULL, 10);
+}
+
+static void
+git_host_usage_write(int fd, unsigned long long usage) {
+	char buffer[32];
+	const int length = snprintf(buffer, sizeof (buffer), "%llu\n", usage);
+
+	if (ftruncate(fd, 0) != 0 || pwrite(fd, buffer, length, 0) != length) {
+		warn("Unable to update usage counter");
+	}
+}
+
+static int
+git_host_usage_open(const char *path) {
+	/* Usage counters are kept per repository, as usage/<owner>/<repo>, and locked while updated */
+	const size_t ownerlen = strchr(path, '/') - path;
+	char owner[ownerlen + 1];
+
+	memcpy(owner, path, ownerlen);
+	owner[ownerlen] = '\0';
+
+	mkdir(CONFIG_GIT_HOME_USAGE, 0777);
+
+	char * const ownerdir = git_host_pathcat(CONFIG_GIT_HOME_USAGE, owner);
+	mkdir(ownerdir, 0777);
+	free(ownerdir);
+
+	char * const counter = git_host_pathcat(CONFIG_GIT_HOME_USAGE, path);
+	const int fd = open(counter, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open %s", counter);
+	}
+	free(counter);
+
+	while (flock(fd, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "flock");
+		}
+	}
+
+	return fd;
+}
+
+static unsigned long long
+git_host_usage_user(const char *owner) {
+	char * const ownerdir = git_host_pathcat(CONFIG_GIT_HOME_USAGE, owner);
+	const int fd = open(ownerdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	unsigned long long usage = 0;
+	struct dirent *entry;
+	DIR *dirp;
+
+	free(ownerdir);
+	if (fd < 0 || (dirp = fdopendir(fd)) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	while (entry = readdir(dirp), entry != NULL) {
+		const int counterfd = *entry->d_name != '.' ? openat(fd, entry->d_name, O_RDONLY | O_CLOEXEC) : -1;
+
+		if (counterfd >= 0) {
+			usage += git_host_usage_read(counterfd);
+			close(counterfd);
+		}
+	}
+
+	closedir(dirp);
+
+	return usage;
+}
+
+static unsigned long long
+git_host_quota_remaining(const char *path) {
+	/* Smallest remaining space between the owner's and the repository's quota, ULLONG_MAX if unlimited */
+	const size_t ownerlen = strchr(path, '/') - path;
+	unsigned long long remaining = ULLONG_MAX;
+	char owner[ownerlen + 1];
+
+	memcpy(owner, path, ownerlen);
+	owner[ownerlen] = '\0';
+
+	const unsigned long long userlimit = git_host_quota_limit("user", owner, CONFIG_GIT_USER_QUOTA);
+	const unsigned long long repolimit = git_host_quota_limit("repository", path, CONFIG_GIT_REPOSITORY_QUOTA);
+
+	if (userlimit != 0) {
+		const unsigned long long usage = git_host_usage_user(owner);
+
+		remaining = usage < userlimit ? userlimit - usage : 0;
+	}
+
+	if (repolimit != 0) {
+		const int fd = git_host_usage_open(path);
+		const unsigned long long usage = git_host_usage_read(fd);
+
+		close(fd);
+		if (usage >= repolimit) {
+			remaining = 0;
+		} else if (repolimit - usage < remaining) {
+			remaining = repolimit - usage;
+		}
+	}
+
+	return remaining;
+}
+
+static int
+git_host_sessions_filter(const struct dirent *entry) {
+	return *entry->d_name >= '0' && *entry->d_name <= '9';
+}
+
+static unsigned int
+git_host_sessions(void) {
+	/*
+	 * Registers the session as sessions/<pid>, locked for as long as it runs, across exec,
+	 * and returns the number of running sessions. Files left unlocked by dead sessions are removed.
+	 * Only used for tuning, a session which can't register counts as alone rather than failing.
+	 */
+	mkdir(CONFIG_GIT_HOME_SESSIONS, 0777);
+
+	const int dirfd = open(CONFIG_GIT_HOME_SESSIONS, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		warn("open "CONFIG_GIT_HOME_SESSIONS);
+		return 1;
+	}
+
+	/* Only appears once locked, so it can't be mistaken for a dead session's */
+	const int fd = openat(dirfd, ".", O_TMPFILE | O_RDWR, 0644);
+	char name[24], procfd[32];
+
+	snprintf(name, sizeof (name), "%ld", (long)getpid());
+	snprintf(procfd, sizeof (procfd), "/proc/self/fd/%d", fd);
+
+	int registered = fd >= 0 && flock(fd, LOCK_EX) == 0;
+
+	/* A leftover with the same pid can only be from a dead session */
+	while (registered && linkat(AT_FDCWD, procfd, dirfd, name, AT_SYMLINK_FOLLOW) != 0) {
+		registered = errno == EEXIST && (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT);
+	}
+
+	if (!registered) {
+		warn("Unable to register session in "CONFIG_GIT_HOME_SESSIONS);
+		if (fd >= 0) {
+			close(fd);
+		}
+		close(dirfd);
+		return 1;
+	}
+
+	struct dirent **namelist;
+	const int count = scandirat(dirfd, ".", &namelist, git_host_sessions_filter, NULL);
+	unsigned int sessions = 1;
+
+	for (int i = 0; i < count; i++) {
+		const int other = strcmp(namelist[i]->d_name, name) != 0
+			? openat(dirfd, namelist[i]->d_name, O_RDONLY | O_CLOEXEC) : -1;
+
+		if (other >= 0) {
+			if (flock(other, LOCK_EX | LOCK_NB) == 0) {
+				unlinkat(dirfd, namelist[i]->d_name, 0);
+			} else {
+				sessions++;
+			}
+			close(other);
+		}
+
+		free(namelist[i]);
+	}
+	if (count >= 0) {
+		free(namelist);
+	}
+
+	close(dirfd);
+
+	return sessions;
+}
+
+static unsigned long long
+git_host_memory_available(void) {
+	/* Memory available without swapping, zero if unknown */
+	FILE * const filep = fopen("/proc/meminfo", "r");
+	unsigned long long available = 0;
+	char *line = NULL;
+	size_t n = 0;
+
+	if (filep == NULL) {
+		return 0;
+	}
+
+	while (getline(&line, &n, filep) >= 0 && sscanf(line, "MemAvailable: %llu kB", &available) != 1);
+
+	free(line);
+	fclose(filep);
+
+	return available * 1024;
+}
+
+static void
+git_host_pack_tuning(const char *repository) {
+	/*
+	 * Shares the host among running sessions, each gets its part of the processors,
+	 * and its part of the available memory, split between delta windows and the delta base cache.
+	 * Neither is sized beyond what the repository's packs could ever use.
+	 */
+	if (!CONFIG_GIT_PACK_TUNING) {
+		return;
+	}
+
+	const unsigned int sessions = git_host_sessions();
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+	const unsigned int threads = online > sessions ? online / sessions : 1;
+	char value[24];
+
+	snprintf(value, sizeof (value), "%u", threads);
+	git_host_config_push("pack.threads", value);
+
+	const unsigned long long budget = git_host_memory_available() / sessions;
+	if (budget != 0) {
+		char * const packs = git_host_pathcat(repository, "objects/pack");
+		const unsigned long long size = git_host_directory_size(AT_FDCWD, packs);
+		unsigned long long window = budget / 2 / threads, cache = budget / 4;
+
+		free(packs);
+
+		if (window > size) {
+			window = size;
+		}
+		if (window < (1ull << 20)) {
+			window = 1ull << 20;
+		}
+
+		if (cache > size) {
+			cache = size;
+		}
+		if (cache < (8ull << 20)) {
+			cache = 8ull << 20;
+		}
+
+		snprintf(value, sizeof (value), "%llu", window);
+		git_host_config_push("pack.windowMemory", value);
+		snprintf(value, sizeof (value), "%llu", cache);
+		git_host_config_push("core.deltaBaseCacheLimit", value);
+	}
+}
+
+static void noreturn
+git_host_exec_rx_tx(int argc, char **argv, enum git_host_mode mode) {
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <repository>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	char * const repository = git_host_repository(argv[1], mode);
+
+	if (mode & GIT_HOST_MODE_WR) {
+		const char * const path = repository + sizeof (CONFIG_GIT_HOME_REPOSITORIES);
+
+		/* Lets git-host's own hooks know which repository they run for */
+		setenv("GIT_HOST_REPOSITORY", path, 1);
+
+		/*
+		 * Queued pushes get the refs advertised once their turn comes, instead of racing for ref locks.
+		 * The queue is held until receive-pack exits, not by its children, as gc --auto may daemonize.
+		 */
+		int queue;
+
+		/* A push which was queued while its repository got hibernated queues again once thawed */
+		while (queue = git_host_queue(repository, path), git_host_thaw(repository, path) != 0) {
+			close(queue);
+		}
+
+		const unsigned long long remaining = git_host_quota_remaining(path);
+
+		if (remaining == 0) {
+			errx(EXIT_FAILURE, "Quota exceeded for '%s'", path);
+		}
+
+		git_host_pack_tuning(repository);
+
+		if (queue >= 0 || remaining != ULLONG_MAX) {
+			char * const packs = git_host_pathcat(repository, "objects/pack");
+			unsigned long long before = 0;
+
+			if (remaining != ULLONG_MAX) {
+				/* Reject oversized pushes while receiving, keep everything packed to account it cheaply */
+				char maxinputsize[24];
+
+				snprintf(maxinputsize, sizeof (maxinputsize), "%llu", remaining);
+				git_host_config_push("receive.maxInputSize", maxinputsize);
+				git_host_config_push("receive.unpackLimit", "1");
+
+				before = git_host_directory_size(AT_FDCWD, packs);
+			}
+
+			char *rxargv[] = { argv[0], repository, NULL };
+			const int status = git_host_wait(git_host_spawn(git_host_execpath(argv[0]), rxargv, -1, -1, -1));
+
+			if (remaining != ULLONG_MAX) {
+				const unsigned long long after = git_host_directory_size(AT_FDCWD, packs);
+				const int fd = git_host_usage_open(path);
+				unsigned long long usage = git_host_usage_read(fd);
+
+				if (after >= before) {
+					usage += after - before;
+				} else {
+					usage = usage > before - after ? usage - (before - after) : 0;
+				}
+
+				git_host_usage_write(fd, usage);
+				close(fd);
+			}
+
+			exit(status < 0 ? EXIT_FAILURE : status);
+		}
+	} else {
+		git_host_pack_tuning(repository);
+	}
+
+	execl(git_host_execpath(argv[0]), argv[0], repository, NULL);
+	err(-1, "exec %s", *argv);
+}
+
+static void noreturn
+git_host_exec_git_receive_pack(int argc, char **argv) {
+	git_host_exec_rx_tx(argc, argv, GIT_HOST_MODE_WR);
+}
+
+static void noreturn
+git_host_exec_git_upload_X(int argc, char **argv) {
+	git_host_exec_rx_tx(argc, argv, GIT_HOST_MODE_RO);
+}
+
+static char *
+git_host_archive_cache_key(const char *repository, char **arguments, int count) {
+	/* Only the plain `[--format=<fmt>] [--prefix=<prefix>] [-<level>] <tree-ish>` requests are cacheable */
+	const char *format = "tar", *prefix = "", *level = "", *treeish = NULL;
+
+	for (int i = 0; i < count; i++) {
+		const char * const argument = arguments[i];
+
+		if (strchr(argument, '\n') != NULL) {
+			return NULL;
+		}
+
+		if (strncmp(argument, "--format=", 9) == 0) {
+			format = argument + 9;
+		} else if (strncmp(argument, "--prefix=", 9) == 0) {
+			prefix = argument + 9;
+		} else if (argument[0] == '-' && argument[1] >= '0' && argument[1] <= '9' && argument[2] == '\0') {
+			level = argument + 1;
+		} else if (*argument != '-' && treeish == NULL) {
+			treeish = argument;
+		} else {
+			return NULL;
+		}
+	}
+
+	if (treeish == NULL) {
+		return NULL;
+	}
+
+	/* Key on the peeled commit rather than the tree, tar headers embed the commit id and date */
+	const size_t treeishlen = strlen(treeish);
+	char commit[treeishlen + sizeof ("^{commit}")], oid[128];
+	char *argv[] = { "git", "--git-dir", (char *)repository, "rev-parse", "--verify", "--quiet", commit, NULL };
+
+	memcpy(commit, treeish, treeishlen);
+	memcpy(commit + treeishlen, "^{commit}", sizeof ("^{commit}"));
+	if (git_host_capture(argv, oid, sizeof (oid)) != 0) {
+		memcpy(commit + treeishlen, "^{tree}", sizeof ("^{tree}"));
+		if (git_host_capture(argv, oid, sizeof (oid)) != 0) {
+			return NULL;
+		}
+	}
+
+	char *key;
+	if (asprintf(&key, "%s %s %s format=%s prefix=%s level=%s\n", repository, oid, treeish, format, prefix, level) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	return key;
+}
+
+struct git_host_archive_cache_entry {
+	uint64_t name;
+	off_t size;
+	struct timespec mtime;
+};
+
+static int
+git_host_archive_cache_entry_compare(const void *lhs, const void *rhs) {
+	const struct git_host_archive_cache_entry * const lentry = lhs, * const rentry = rhs;
+
+	if (lentry->mtime.tv_sec != rentry->mtime.tv_sec) {
+		return lentry->mtime.tv_sec < rentry->mtime.tv_sec ? -1 : 1;
+	}
+
+	return (lentry->mtime.tv_nsec > rentry->mtime.tv_nsec) - (lentry->mtime.tv_nsec < rentry->mtime.tv_nsec);
+}
+
+static void
+git_host_archive_cache_evict(int dirfd) {
+	/* Least recently used entries go first, hits refresh their modification time */
+	DIR * const dirp = fdopendir(dup(dirfd));
+	struct git_host_archive_cache_entry *entries = NULL;
+	unsigned long long total = 0;
+	struct dirent *entry;
+	size_t count = 0;
+
+	if (dirp == NULL) {
+		return;
+	}
+
+	while (entry = readdir(dirp), entry != NULL) {
+		struct stat st;
+		char *end;
+
+		/* Skips dot files, which also covers entries still being written */
+		const uint64_t name = strtoull(entry->d_name, &end, 16);
+		if (*entry->d_name == '.' || *end != '\0'
+			|| fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		entries = realloc(entries, sizeof (*entries) * (count + 1));
+		if (entries == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		entries[count++] = (struct git_host_archive_cache_entry) {
+			.name = name,
+			.size = st.st_size,
+			.mtime = st.st_mtim,
+		};
+		total += st.st_size;
+	}
+
+	qsort(entries, count, sizeof (*entries), git_host_archive_cache_entry_compare);
+
+	for (size_t i = 0; i < count && total > CONFIG_GIT_ARCHIVE_CACHE_SIZE; i++) {
+		char name[17];
+
+		snprintf(name, sizeof (name), "%016llx", (unsigned long long)entries[i].name);
+		if (unlinkat(dirfd, name, 0) == 0) {
+			total -= entries[i].size;
+		}
+	}
+
+	free(entries);
+	closedir(dirp);
+}
+
+static void noreturn
+git_host_exec_git_upload_archive(int argc, char **argv) {
+	char *arguments[GIT_HOST_ARCHIVE_ARGS], *argument;
+	int count = 0, dirfd = -1, tmpfd = -1;
+	char name[17];
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <repository>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	char * const repository = git_host_repository(argv[1], GIT_HOST_MODE_RO);
+
+	while (argument = git_host_packet_read(STDIN_FILENO), argument != NULL) {
+		if (count == GIT_HOST_ARCHIVE_ARGS) {
+			errx(EXIT_FAILURE, "Too many options (>%d)", GIT_HOST_ARCHIVE_ARGS);
+		}
+
+		if (strncmp(argument, "argument ", 9) != 0) {
+			errx(EXIT_FAILURE, "'argument' token or flush expected");
+		}
+
+		arguments[count++] = argument + 9;
+	}
+
+	char * const key = CONFIG_GIT_ARCHIVE_CACHE_SIZE != 0 ? git_host_archive_cache_key(repository, arguments, count) : NULL;
+	if (key != NULL) {
+		snprintf(name, sizeof (name), "%016llx", (unsigned long long)git_host_fnv1a(key));
+		mkdir(CONFIG_GIT_HOME_ARCHIVE_CACHE, 0777);
+		dirfd = open(CONFIG_GIT_HOME_ARCHIVE_CACHE, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	if (dirfd >= 0) {
+		const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+
+		if (fd >= 0) {
+			const size_t keylen = strlen(key);
+			char header[keylen];
+
+			if (git_host_read_full(fd, header, keylen) == 0 && memcmp(header, key, keylen) == 0) {
+				futimens(fd, NULL);
+				git_host_packet_write(STDOUT_FILENO, "ACK\n", 4);
+				git_host_packet_flush(STDOUT_FILENO);
+				git_host_sideband_sendfile(fd, keylen);
+				git_host_packet_flush(STDOUT_FILENO);
+				exit(EXIT_SUCCESS);
+			}
+
+			close(fd);
+		}
+
+		/* Anonymous until complete, so concurrent readers never see a partial entry */
+		tmpfd = openat(dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+		if (tmpfd >= 0) {
+			git_host_write_full(tmpfd, key, strlen(key));
+		}
+	}
+
+	/* Cache miss, or uncacheable request, let git's archive writer produce it */
+	char *writerargv[12] = { "git" };
+	int writerargc = 1, in[2], out[2], errs[2];
+
+	/* Prefer parallel compressors, git's own gzip is single-threaded */
+	const unsigned int threads = git_host_threads(CONFIG_GIT_ARCHIVE_THREADS);
+	if (git_host_which(CONFIG_GIT_ARCHIVE_GZIP) == 0) {
+		static const char * const gzipformats[] = { "tgz", "tar.gz" };
+
+		for (unsigned int i = 0; i < sizeof (gzipformats) / sizeof (*gzipformats); i++) {
+			writerargv[writerargc++] = "-c";
+			if (asprintf(&writerargv[writerargc++], "tar.%s.command=%s -cn -p %u",
+				gzipformats[i], CONFIG_GIT_ARCHIVE_GZIP, threads) < 0) {
+				err(EXIT_FAILURE, "asprintf");
+			}
+		}
+	}
+
+	if (git_host_which(CONFIG_GIT_ARCHIVE_ZSTD) == 0) {
+		writerargv[writerargc++] = "-c";
+		if (asprintf(&writerargv[writerargc++], "tar.tar.zst.command=%s -c -q -T%u",
+			CONFIG_GIT_ARCHIVE_ZSTD, threads) < 0) {
+			err(EXIT_FAILURE, "asprintf");
+		}
+		writerargv[writerargc++] = "-c";
+		writerargv[writerargc++] = "tar.tar.zst.remote=true";
+	}
+
+	writerargv[writerargc++] = "upload-archive--writer";
+	writerargv[writerargc++] = repository;
+	writerargv[writerargc] = NULL;
+
+	if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0 || pipe2(errs, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), writerargv, in[0], out[1], errs[1]);
+	close(in[0]);
+	close(out[1]);
+	close(errs[1]);
+
+	for (int i = 0; i < count; i++) {
+		const size_t length = strlen(arguments[i]);
+		char packet[length + sizeof ("argument \n")];
+
+		snprintf(packet, sizeof (packet), "argument %s\n", arguments[i]);
+		git_host_packet_write(in[1], packet, sizeof (packet) - 1);
+	}
+	git_host_packet_flush(in[1]);
+	close(in[1]);
+
+	git_host_packet_write(STDOUT_FILENO, "ACK\n", 4);
+	git_host_packet_flush(STDOUT_FILENO);
+
+	struct pollfd fds[] = {
+		{ .fd = out[0], .events = POLLIN },
+		{ .fd = errs[0], .events = POLLIN },
+	};
+	static char buffer[GIT_HOST_SIDEBAND_MAX];
+
+	while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		for (int i = 0; i < 2; i++) {
+			if (fds[i].fd < 0 || fds[i].revents == 0) {
+				continue;
+			}
+
+			const ssize_t readed = read(fds[i].fd, buffer, sizeof (buffer));
+			if (readed <= 0) {
+				if (readed < 0 && errno == EINTR) {
+					continue;
+				}
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				continue;
+			}
+
+			git_host_sideband_write(i + 1, buffer, readed);
+
+			if (i == 0 && tmpfd >= 0 && write(tmpfd, buffer, readed) != readed) {
+				close(tmpfd);
+				tmpfd = -1;
+			}
+		}
+	}
+
+	if (git_host_wait(pid) != 0) {
+		static const char message[] = "upload-archive: archiver died with error";
+
+		git_host_sideband_write(3, message, sizeof (message) - 1);
+		exit(EXIT_FAILURE);
+	}
+
+	git_host_packet_flush(STDOUT_FILENO);
+
+	if (tmpfd >= 0) {
+		char procpath[64];
+
+		snprintf(procpath, sizeof (procpath), "/proc/self/fd/%d", tmpfd);
+		if (linkat(AT_FDCWD, procpath, dirfd, name, AT_SYMLINK_FOLLOW) == 0) {
+			git_host_archive_cache_evict(dirfd);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static int
+git_host_cgroup_write(const char *cgroup, const char *file, const char *value) {
+	char * const path = git_host_pathcat(cgroup, file);
+	const int fd = open(path, O_WRONLY | O_CLOEXEC);
+	const size_t length = strlen(value);
+	int ret = -1;
+
+	if (fd >= 0) {
+		ret = write(fd, value, length) == (ssize_t)length ? 0 : -1;
+		close(fd);
+	}
+	free(path);
+
+	return ret;
+}
+
+static char *
+git_host_cgroup_child(const char *parent, const char *name) {
+	/* Creates the child cgroup if needed, controllers which aren't delegated are simply left out */
+	static const char * const controllers[] = { "+cpu", "+io", "+memory" };
+
+	for (unsigned int i = 0; i < sizeof (controllers) / sizeof (*controllers); i++) {
+		git_host_cgroup_write(parent, "cgroup.subtree_control", controllers[i]);
+	}
+
+	char * const child = git_host_pathcat(parent, name);
+	if (mkdir(child, 0777) != 0 && errno != EEXIST) {
+		warn("mkdir %s", child);
+		free(child);
+		return NULL;
+	}
+
+	return child;
+}
+
+static void
+git_host_cgroup(const char *user, const char *command, enum git_host_class class) {
+	/*
+	 * Sessions run in <cgroup>/<class>/<user>/<command>: classes share the host according to their weights,
+	 * and the memory of each user's command is capped, so a pathological pack-objects only hurts its own.
+	 * Isolation is best effort, sessions are never refused because of it.
+	 */
+	static const char * const classes[] = {
+		[GIT_HOST_CLASS_INTERACTIVE] = "interactive",
+		[GIT_HOST_CLASS_BACKGROUND] = "background",
+	};
+	static const unsigned int weights[] = {
+		[GIT_HOST_CLASS_INTERACTIVE] = CONFIG_GIT_CGROUP_INTERACTIVE_WEIGHT,
+		[GIT_HOST_CLASS_BACKGROUND] = CONFIG_GIT_CGROUP_BACKGROUND_WEIGHT,
+	};
+
+	if (*CONFIG_GIT_CGROUP == '\0') {
+		return;
+	}
+
+	if (*user == '.' || strchr(user, '/') != NULL) {
+		user = "-";
+	}
+
+	char * const classdir = git_host_cgroup_child(CONFIG_GIT_CGROUP, classes[class]);
+	char * const userdir = classdir != NULL ? git_host_cgroup_child(classdir, user) : NULL;
+	char * const commanddir = userdir != NULL ? git_host_cgroup_child(userdir, command) : NULL;
+
+	if (commanddir != NULL) {
+		char weight[16];
+
+		snprintf(weight, sizeof (weight), "%u", weights[class]);
+		git_host_cgroup_write(classdir, "cpu.weight", weight);
+		git_host_cgroup_write(classdir, "io.weight", weight);
+		git_host_cgroup_write(commanddir, "memory.max", CONFIG_GIT_CGROUP_MEMORY_MAX);
+
+		if (git_host_cgroup_write(commanddir, "cgroup.procs", "0") != 0) {
+			warn("Unable to join cgroup %s", commanddir);
+		}
+	}
+
+	free(commanddir);
+	free(userdir);
+	free(classdir);
+}
+
+/* From linux/ioprio.h, which isn't always installed */
+#define GIT_HOST_IOPRIO_CLASS_BE    2
+#define GIT_HOST_IOPRIO_CLASS_IDLE  3
+#define GIT_HOST_IOPRIO_WHO_PROCESS 1
+#define GIT_HOST_IOPRIO_VALUE(class, level) ((class) << 13 | (level))
+
+static enum git_host_class
+git_host_user_class(const char *user, enum git_host_class class) {
+	/* Members of the batch group, typically bots and CI, only ever run in the background */
+	if (*CONFIG_GIT_BATCH_GROUP != '\0' && user != NULL) {
+		const struct git_host_acl * const acl = git_host_acl_open();
+		char **groups;
+		const int count = git_host_groups(user, acl != NULL ? acl->header->epoch : 0, &groups);
+
+		for (int i = 0; i < count; i++) {
+			if (strcmp(groups[i], CONFIG_GIT_BATCH_GROUP) == 0) {
+				return GIT_HOST_CLASS_BACKGROUND;
+			}
+		}
+	}
+
+	return class;
+}
+
+static void
+git_host_priority(enum git_host_class class) {
+	/*
+	 * Interactive sessions keep the default scheduling, at the highest best-effort IO priority.
+	 * Background work yields both processor and disk, or only uses them when idle if so configured.
+	 * Priorities can only be lowered, failures are ignored as they only affect fairness.
+	 */
+	int ioprio, policy, nice;
+
+	switch (class) {
+	case GIT_HOST_CLASS_INTERACTIVE:
+		ioprio = GIT_HOST_IOPRIO_VALUE(GIT_HOST_IOPRIO_CLASS_BE, 0);
+		policy = SCHED_OTHER;
+		nice = 0;
+		break;
+	case GIT_HOST_CLASS_BACKGROUND:
+		if (CONFIG_GIT_BACKGROUND_IDLE) {
+			ioprio = GIT_HOST_IOPRIO_VALUE(GIT_HOST_IOPRIO_CLASS_IDLE, 0);
+			policy = SCHED_IDLE;
+		} else {
+			ioprio = GIT_HOST_IOPRIO_VALUE(GIT_HOST_IOPRIO_CLASS_BE, 7);
+			policy = SCHED_BATCH;
+		}
+		nice = CONFIG_GIT_BACKGROUND_NICE;
+		break;
+	default:
+		abort();
+	}
+
+	syscall(SYS_ioprio_set, GIT_HOST_IOPRIO_WHO_PROCESS, 0, ioprio);
+
+	const struct sched_param param = { .sched_priority = 0 };
+	sched_setscheduler(0, policy, &param);
+
+	if (nice > getpriority(PRIO_PROCESS, 0)) {
+		setpriority(PRIO_PROCESS, 0, nice);
+	}
+}
+
+static void noreturn
+git_host_exec(int argc, char **argv) {
+	static const struct {
+		const char * const name;
+		void (* const exec)(int, char **);
+		const enum git_host_class class;
+	} commands[] = {
+		{ "delete",             git_host_exec_delete,             GIT_HOST_CLASS_INTERACTIVE },
+		{ "dir",                git_host_exec_dir,                GIT_HOST_CLASS_INTERACTIVE },
+		{ "init",               git_host_exec_init,               GIT_HOST_CLASS_INTERACTIVE },
+		{ "git-receive-pack",   git_host_exec_git_receive_pack,   GIT_HOST_CLASS_INTERACTIVE },
+		{ "git-upload-archive", git_host_exec_git_upload_archive, GIT_HOST_CLASS_BACKGROUND },
+		{ "git-upload-pack",    git_host_exec_git_upload_X,       GIT_HOST_CLASS_INTERACTIVE },
+		{ "rename",             git_host_exec_rename,             GIT_HOST_CLASS_INTERACTIVE },
+		{ "wait",               git_host_exec_wait,               GIT_HOST_CLASS_INTERACTIVE },
+	};
+	const unsigned int commandscount = sizeof (commands) / sizeof (*commands);
+	unsigned int i = 0;
+
+	while (i < commandscount && strcmp(*argv, commands[i].name) != 0) {
+		i++;
+	}
+
+	if (i == commandscount) {
+		errx(EXIT_FAILURE, "Invalid command '%s'", *argv);
+	}
+
+	const char * const user = getenv("SSH_AUTHORIZED_BY");
+	const enum git_host_class class = git_host_user_class(user, commands[i].class);
+	git_host_cgroup(user != NULL ? user : "-", commands[i].name, class);
+	git_host_priority(class);
+
+	GIT_HOST_PROBE(git_host, exec, commands[i].name, user, class, argc, argv);
+	commands[i].exec(argc, argv);
+	abort();
+}
+
+static void
+git_host_foreach_repository(void (*callback)(const char *, const char *, void *), void *data, int hibernated) {
+	/* Calls back with the <owner>/<repo> path and the location of every repository, hibernated ones only if asked */
+	DIR * const owners = opendir(CONFIG_GIT_HOME_REPOSITORIES);
+	struct dirent *owner;
+
+	if (owners == NULL) {
+		err(EXIT_FAILURE, "opendir "CONFIG_GIT_HOME_REPOSITORIES);
+	}
+
+	while (owner = readdir(owners), owner != NULL) {
+		char * const ownerdir = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, owner->d_name);
+		struct dirent **repos;
+		int count;
+
+		if (*owner->d_name != '.' && (count = scandir(ownerdir, &repos, git_host_dir_filter, alphasort)) >= 0) {
+			for (int i = 0; i < count; i++) {
+				char * const path = git_host_pathcat(owner->d_name, repos[i]->d_name);
+				char * const repository = git_host_pathcat(ownerdir, repos[i]->d_name);
+				struct stat st;
+
+				/* Otherwise hibernated repositories are left alone until thawed */
+				if (stat(repository, &st) == 0 && (S_ISDIR(st.st_mode) || (hibernated && S_ISREG(st.st_mode)))) {
+					callback(path, repository, data);
+				}
+
+				free(repository);
+				free(path);
+				free(repos[i]);
+			}
+			free(repos);
+		}
+
+		free(ownerdir);
+	}
+
+	closedir(owners);
+}
+
+struct git_host_acl_group {
+	char *name;
+	char **members;
+	int count;
+};
+
+struct git_host_acl_grant {
+	char *principal;
+	char *path;
+	enum git_host_mode mode;
+	size_t line;
+};
+
+struct git_host_acl_entry {
+	char *key;
+	enum git_host_mode mode;
+	uint32_t bucket;
+};
+
+struct git_host_acl_compiler {
+	struct git_host_acl_group *groups;
+	size_t groupscount;
+	struct git_host_acl_grant *grants;
+	size_t grantscount;
+	struct git_host_acl_entry *entries;
+	size_t entriescount;
+};
+
+static void
+git_host_acl_compiler_entry(struct git_host_acl_compiler *compiler, const char *user, const char *path, enum git_host_mode mode) {
+	struct git_host_acl_entry *entry;
+
+	compiler->entries = realloc(compiler->entries, sizeof (*compiler->entries) * (compiler->entriescount + 1));
+	if (compiler->entries == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	entry = compiler->entries + compiler->entriescount++;
+	if (asprintf(&entry->key, "%s %s", user, path) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+	entry->mode = mode;
+}
+
+static void
+git_host_acl_compiler_expand(struct git_host_acl_compiler *compiler, const struct git_host_acl_grant *grant,
+	const char *principal, unsigned int depth) {
+
+	if (*principal != '@') {
+		git_host_acl_compiler_entry(compiler, principal, grant->path, grant->mode);
+		return;
+	}
+
+	if (depth == 16) {
+		errx(EXIT_FAILURE, CONFIG_GIT_HOME_ACL":%zu: Too many nested groups expanding '%s'", grant->line, grant->principal);
+	}
+
+	size_t i = 0;
+	while (i < compiler->groupscount && strcmp(compiler->groups[i].name, principal + 1) != 0) {
+		i++;
+	}
+
+	if (i == compiler->groupscount) {
+		errx(EXIT_FAILURE, CONFIG_GIT_HOME_ACL":%zu: Unknown group '%s'", grant->line, principal + 1);
+	}
+
+	for (int j = 0; j < compiler->groups[i].count; j++) {
+		git_host_acl_compiler_expand(compiler, grant, compiler->groups[i].members[j], depth + 1);
+	}
+}
+
+static void
+git_host_acl_compiler_parse(struct git_host_acl_compiler *compiler, FILE *filep) {
+	char *line = NULL;
+	size_t n = 0, lineno = 0;
+
+	while (getline(&line, &n, filep) >= 0) {
+		char *saveptr, *tokens[4];
+		int count = 0;
+
+		lineno++;
+		line[strcspn(line, "#")] = '\0';
+
+		char *token = strtok_r(line, " \t\n", &saveptr);
+		if (token == NULL) {
+			continue;
+		}
+
+		if (strcmp(token, "group") == 0) {
+			struct git_host_acl_group group = { .members = NULL, .count = 0 };
+
+			if (token = strtok_r(NULL, " \t\n", &saveptr), token == NULL) {
+				errx(EXIT_FAILURE, CONFIG_GIT_HOME_ACL":%zu: Missing group name", lineno);
+			}
+
+			group.name = xstrdup(token);
+			while (token = strtok_r(NULL, " \t\n", &saveptr), token != NULL) {
+				git_host_array_push(xstrdup(token), &group.count, &group.members);
+			}
+
+			compiler->groups = realloc(compiler->groups, sizeof (*compiler->groups) * (compiler->groupscount + 1));
+			if (compiler->groups == NULL) {
+				err(EXIT_FAILURE, "realloc");
+			}
+			compiler->groups[compiler->groupscount++] = group;
+			continue;
+		}
+
+		tokens[count++] = token;
+		while (count < 4 && (tokens[count] = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+			count++;
+		}
+
+		struct git_host_acl_grant grant = { .line = lineno };
+		if (strcmp(tokens[0], "private") == 0 && count == 2) {
+			grant.principal = "*";
+			grant.mode = GIT_HOST_MODE_NA;
+		} else if (strcmp(tokens[0], "grant") == 0 && count == 4) {
+			static const char * const modes[] = {
+				[GIT_HOST_MODE_NA] = "na",
+				[GIT_HOST_MODE_RO] = "ro",
+				[GIT_HOST_MODE_RW] = "rw",
+			};
+			unsigned int mode = 0;
+
+			/* Write without read is meaningless to git, it has no name */
+			while (mode < sizeof (modes) / sizeof (*modes) && (modes[mode] == NULL || strcmp(modes[mode], tokens[3]) != 0)) {
+				mode++;
+			}
+
+			if (mode == sizeof (modes) / sizeof (*modes)) {
+				errx(EXIT_FAILURE, CONFIG_GIT_HOME_ACL":%zu: Invalid mode '%s', expected na, ro or rw", lineno, tokens[3]);
+			}
+
+			grant.principal = xstrdup(tokens[2]);
+			grant.mode = mode;
+		} else {
+			errx(EXIT_FAILURE, CONFIG_GIT_HOME_ACL":%zu: Invalid rule, expected one of:\n"
+				"\tgroup <name> [<user>|@<group>]...\n"
+				"\tgrant <owner>/<repo> <user>|@<group>|%%<system group>|* na|ro|rw\n"
+				"\tprivate <owner>/<repo>", lineno);
+		}
+
+		/* Keys must match exactly what git_host_repository() checks */
+		grant.path = xstrdup(tokens[1]);
+		if (git_host_normalize_path(grant.path) != 0 || strcmp(grant.path, tokens[1]) != 0
+			|| git_host_check_repository_shape(grant.path) != 0) {
+			errx(EXIT_FAILURE, CONFIG_GIT_HOME_ACL":%zu: Invalid repository path '%s'", lineno, tokens[1]);
+		}
+
+		compiler->grants = realloc(compiler->grants, sizeof (*compiler->grants) * (compiler->grantscount + 1));
+		if (compiler->grants == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+		compiler->grants[compiler->grantscount++] = grant;
+	}
+
+	free(line);
+}
+
+static int
+git_host_acl_entry_compare(const void *lhs, const void *rhs) {
+	const struct git_host_acl_entry * const lentry = lhs, * const rentry = rhs;
+
+	return strcmp(lentry->key, rentry->key);
+}
+
+static int
+git_host_acl_bucket_compare(const void *lhs, const void *rhs, void *sizes) {
+	const uint32_t lsize = ((const uint32_t *)sizes)[*(const uint32_t *)lhs];
+	const uint32_t rsize = ((const uint32_t *)sizes)[*(const uint32_t *)rhs];
+
+	return (lsize < rsize) - (lsize > rsize);
+}
+
+static void noreturn
+git_host_maintenance_acl_compile(int argc, char **argv) {
+	struct git_host_acl_compiler compiler = { 0 };
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE * const sourcep = fopen(CONFIG_GIT_HOME_ACL, "r");
+	if (sourcep == NULL) {
+		err(EXIT_FAILURE, "fopen "CONFIG_GIT_HOME_ACL);
+	}
+	git_host_acl_compiler_parse(&compiler, sourcep);
+	fclose(sourcep);
+
+	for (size_t i = 0; i < compiler.grantscount; i++) {
+		git_host_acl_compiler_expand(&compiler, compiler.grants + i, compiler.grants[i].principal, 0);
+	}
+
+	/* Merge duplicate keys, several grants reaching the same user add up */
+	struct git_host_acl_entry * const entries = compiler.entries;
+	size_t count = 0;
+
+	qsort(entries, compiler.entriescount, sizeof (*entries), git_host_acl_entry_compare);
+	for (size_t i = 0; i < compiler.entriescount; i++) {
+		if (count != 0 && strcmp(entries[count - 1].key, entries[i].key) == 0) {
+			entries[count - 1].mode |= entries[i].mode;
+			free(entries[i].key);
+		} else {
+			entries[count++] = entries[i];
+		}
+	}
+
+	if (count > UINT32_MAX / 2) {
+		errx(EXIT_FAILURE, "Too many access-control entries");
+	}
+
+	/* Hash and displace: place the biggest buckets first, searching each a seed without collisions */
+	struct git_host_acl_header header = {
+		.magic = GIT_HOST_ACL_MAGIC,
+		.epoch = 1,
+		.buckets = count / 4 + 1,
+		.slots = count + count / 4 + 1,
+	};
+	uint32_t * const seeds = calloc(header.buckets, sizeof (*seeds));
+	uint32_t * const sizes = calloc(header.buckets, sizeof (*sizes));
+	uint32_t * const order = calloc(header.buckets, sizeof (*order));
+	uint32_t * const members = calloc(count + 1, sizeof (*members));
+	struct git_host_acl_slot * const slots = calloc(header.slots, sizeof (*slots));
+	uint8_t * const taken = calloc(header.slots, sizeof (*taken));
+
+	if (seeds == NULL || sizes == NULL || order == NULL || members == NULL || slots == NULL || taken == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const size_t keylen = strlen(entries[i].key);
+
+		if (keylen > UINT16_MAX) {
+			errx(EXIT_FAILURE, "Access-control entry too long '%s'", entries[i].key);
+		}
+
+		entries[i].bucket = git_host_acl_hash(entries[i].key, keylen, 0) % header.buckets;
+		sizes[entries[i].bucket]++;
+	}
+
+	/* Counting sort of the entries by bucket */
+	uint32_t * const offsets = calloc(header.buckets + 1, sizeof (*offsets));
+	if (offsets == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (uint32_t b = 0; b < header.buckets; b++) {
+		offsets[b + 1] = offsets[b] + sizes[b];
+		order[b] = b;
+	}
+	for (size_t i = 0; i < count; i++) {
+		members[offsets[entries[i].bucket]++] = i;
+	}
+	for (uint32_t b = 0; b < header.buckets; b++) {
+		offsets[b] -= sizes[b];
+	}
+
+	qsort_r(order, header.buckets, sizeof (*order), git_host_acl_bucket_compare, sizes);
+
+	for (uint32_t o = 0; o < header.buckets && sizes[order[o]] != 0; o++) {
+		const uint32_t bucket = order[o], size = sizes[bucket];
+		uint32_t chosen[size];
+		uint32_t seed = 0, placed;
+
+		do {
+			if (++seed == 1 << 24) {
+				errx(EXIT_FAILURE, "Unable to build a perfect hash for the access-control entries");
+			}
+
+			for (placed = 0; placed < size; placed++) {
+				const char * const key = entries[members[offsets[bucket] + placed]].key;
+				const uint32_t slot = git_host_acl_hash(key, strlen(key), seed) % header.slots;
+				uint32_t i = 0;
+
+				while (i < placed && chosen[i] != slot) {
+					i++;
+				}
+
+				if (taken[slot] || i != placed) {
+					break;
+				}
+
+				chosen[placed] = slot;
+			}
+		} while (placed != size);
+
+		seeds[bucket] = seed;
+		for (uint32_t i = 0; i < size; i++) {
+			const struct git_host_acl_entry * const entry = entries + members[offsets[bucket] + i];
+			const size_t keylen = strlen(entry->key);
+
+			if (header.strings + keylen > UINT32_MAX) {
+				errx(EXIT_FAILURE, "Too many access-control entries");
+			}
+
+			taken[chosen[i]] = 1;
+			slots[chosen[i]] = (struct git_host_acl_slot) {
+				.offset = header.strings,
+				.length = keylen,
+				.mode = entry->mode,
+			};
+			header.strings += keylen;
+		}
+	}
+
+	/* Bump the previous epoch, so consumers can tell databases apart */
+	const int oldfd = open(CONFIG_GIT_HOME_ACL_DATABASE, O_RDONLY | O_CLOEXEC);
+	if (oldfd >= 0) {
+		struct git_host_acl_header old;
+
+		if (git_host_read_full(oldfd, &old, sizeof (old)) == 0
+			&& memcmp(old.magic, GIT_HOST_ACL_MAGIC, sizeof (old.magic)) == 0) {
+			header.epoch = old.epoch + 1;
+		}
+		close(oldfd);
+	}
+
+	/* Written aside and renamed over, running sessions keep their mapping, strings follow placement order */
+	char tmppath[] = CONFIG_GIT_HOME_ACL_DATABASE".XXXXXX";
+	const int fd = mkostemp(tmppath, O_CLOEXEC);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "mkostemp %s", tmppath);
+	}
+	fchmod(fd, 0644);
+
+	git_host_write_full(fd, &header, sizeof (header));
+	git_host_write_full(fd, seeds, sizeof (*seeds) * header.buckets);
+	git_host_write_full(fd, slots, sizeof (*slots) * header.slots);
+	for (uint32_t o = 0; o < header.buckets && sizes[order[o]] != 0; o++) {
+		for (uint32_t i = 0; i < sizes[order[o]]; i++) {
+			const char * const key = entries[members[offsets[order[o]] + i]].key;
+
+			git_host_write_full(fd, key, strlen(key));
+		}
+	}
+
+	if (fsync(fd) != 0 || close(fd) != 0 || rename(tmppath, CONFIG_GIT_HOME_ACL_DATABASE) != 0) {
+		const int errnum = errno;
+
+		unlink(tmppath);
+		errno = errnum;
+		err(EXIT_FAILURE, "Unable to write "CONFIG_GIT_HOME_ACL_DATABASE);
+	}
+
+	printf("%zu entries compiled into "CONFIG_GIT_HOME_ACL_DATABASE", epoch %llu\n",
+		count, (unsigned long long)header.epoch);
+
+	exit(EXIT_SUCCESS);
+}
+
+static unsigned long long git_host_tree_size_total;
+
+static int
+git_host_tree_size_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	if (type == FTW_F && S_ISREG(st->st_mode)) {
+		git_host_tree_size_total += st->st_size;
+	}
+
+	return 0;
+}
+
+static unsigned long long
+git_host_tree_size(const char *path) {
+	/* The trailing slash follows the repository itself if it was migrated to another tier, but nothing below */
+	char root[strlen(path) + 2];
+
+	snprintf(root, sizeof (root), "%s/", path);
+	git_host_tree_size_total = 0;
+
+	if (nftw(root, git_host_tree_size_entry, 16, FTW_PHYS) != 0) {
+		warn("nftw %s", path);
+	}
+
+	return git_host_tree_size_total;
+}
+
+static void
+git_host_maintenance_quota_reconcile_repository(const char *path, const char *repository, void *data) {
+	const int fd = git_host_usage_open(path);
+	struct stat st;
+	unsigned long long size;
+
+	/* Hibernated repositories keep the usage of their thawed self, at least their archive's if never counted */
+	if (stat(repository, &st) == 0 && S_ISREG(st.st_mode)) {
+		size = git_host_usage_read(fd);
+		if (size == 0) {
+			size = st.st_size;
+			git_host_usage_write(fd, size);
+		}
+	} else {
+		size = git_host_tree_size(repository);
+		git_host_usage_write(fd, size);
+	}
+	close(fd);
+
+	printf("%s %llu\n", path, size);
+}
+
+static void noreturn
+git_host_maintenance_quota_reconcile(int argc, char **argv) {
+	/* Recompute every usage counter from scratch, correcting drift from the incremental updates */
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	git_host_foreach_repository(git_host_maintenance_quota_reconcile_repository, NULL, 1);
+
+	/* Drop counters of repositories which don't exist anymore */
+	DIR * const usages = opendir(CONFIG_GIT_HOME_USAGE);
+	struct dirent *usage;
+
+	while (usages != NULL && (usage = readdir(usages)) != NULL) {
+		char * const usagedir = git_host_pathcat(CONFIG_GIT_HOME_USAGE, usage->d_name);
+		struct dirent **counters;
+		int count;
+
+		if (*usage->d_name == '.' || (count = scandir(usagedir, &counters, git_host_dir_filter, alphasort)) < 0) {
+			free(usagedir);
+			continue;
+		}
+
+		for (int i = 0; i < count; i++) {
+			char * const path = git_host_pathcat(usage->d_name, counters[i]->d_name);
+			char * const repository = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path);
+			struct stat st;
+
+			if (stat(repository, &st) != 0 && errno == ENOENT) {
+				char * const counter = git_host_pathcat(usagedir, counters[i]->d_name);
+
+				unlink(counter);
+				free(counter);
+			}
+
+			free(repository);
+			free(path);
+			free(counters[i]);
+		}
+
+		free(counters);
+		free(usagedir);
+	}
+
+	if (usages != NULL) {
+		closedir(usages);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static int
+git_host_maintenance_journal_print(uint64_t sequence, const char *payload, size_t length, void *data) {
+	printf("%llu %.*s\n", (unsigned long long)sequence, (int)length, payload);
+	return 0;
+}
+
+static void noreturn
+git_host_maintenance_journal(int argc, char **argv) {
+	char *end;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [<sequence>]\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	const uint64_t since = argc == 2 ? strtoull(argv[1], &end, 10) : 0;
+	if (argc == 2 && (*argv[1] == '\0' || *end != '\0')) {
+		errx(EXIT_FAILURE, "Invalid sequence '%s'", argv[1]);
+	}
+
+	git_host_journal_read(since, git_host_maintenance_journal_print, NULL);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+git_host_maintenance_install_hooks_repository(const char *path, const char *repository, void *data) {
+	git_host_install_hooks(repository);
+}
+
+static void noreturn
+git_host_maintenance_install_hooks(int argc, char **argv) {
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	git_host_foreach_repository(git_host_maintenance_install_hooks_repository, NULL, 0);
+
+	exit(EXIT_SUCCESS);
+}
+
+static int
+git_host_copy_file(int srcdirfd, int dstdirfd, const char *name) {
+	/* Copies a file between directories, it only appears under its name once complete */
+	const int in = openat(srcdirfd, name, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+
+	if (in < 0) {
+		return -1; /* Removed by a repack since listed */
+	}
+
+	if (fstat(in, &st) != 0) {
+		err(EXIT_FAILURE, "Unable to copy %s", name);
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		close(in);
+		return -1; /* A hibernated repository thawed since listed */
+	}
+
+	const int out = openat(dstdirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0444);
+	if (out < 0) {
+		err(EXIT_FAILURE, "Unable to copy %s", name);
+	}
+
+	off_t copied = 0;
+	while (copied < st.st_size) {
+		ssize_t ret = copy_file_range(in, NULL, out, NULL, st.st_size - copied, 0);
+
+		/* Kernels before 5.3 can't copy across file systems */
+		if (ret < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+			ret = sendfile(out, in, NULL, st.st_size - copied);
+		}
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "Unable to copy %s", name);
+		}
+
+		if (ret == 0) {
+			break;
+		}
+
+		copied += ret;
+	}
+
+	/* Keeps the mode and times, the latter tell tier migrations which files changed since copied */
+	const struct timespec times[] = { st.st_atim, st.st_mtim };
+	char procfd[32];
+	snprintf(procfd, sizeof (procfd), "/proc/self/fd/%d", out);
+
+	if (fchmod(out, st.st_mode & 07777) != 0 || futimens(out, times) != 0
+		|| fsync(out) != 0 || (linkat(AT_FDCWD, procfd, dstdirfd, name, AT_SYMLINK_FOLLOW) != 0 && errno != EEXIST)) {
+		err(EXIT_FAILURE, "Unable to copy %s", name);
+	}
+
+	close(out);
+	close(in);
+
+	return 0;
+}
+
+static int
+git_host_replicate_filter(const struct dirent *entry) {
+	/* Only immutable files, named after their contents: packs and loose objects */
+	const char * const name = entry->d_name;
+
+	if (strncmp(name, "pack-", 5) == 0) {
+		const char * const extension = strrchr(name, '.');
+
+		return extension != NULL && (strcmp(extension, ".pack") == 0 || strcmp(extension, ".idx") == 0
+			|| strcmp(extension, ".rev") == 0 || strcmp(extension, ".bitmap") == 0);
+	}
+
+	return strspn(name, "0123456789abcdef") == strlen(name) && strlen(name) >= 38;
+}
+
+struct git_host_replica {
+	struct dirent **namelist;
+	int count;
+	int complete;
+};
+
+static int
+git_host_replicate_compare(const void *lhs, const void *rhs) {
+	/* Same order as alphasort(3) */
+	const struct dirent * const * const lentry = lhs, * const * const rentry = rhs;
+
+	return strcoll((*lentry)->d_name, (*rentry)->d_name);
+}
+
+static int
+git_host_replicate_objects(const char *repository, const char *mirror, const char *directory, struct git_host_replica *replica) {
+	/* Copies the objects missing from the mirror, indexes last so the mirror never sees a pack without its data */
+	char * const srcdir = git_host_pathcat(repository, directory);
+	char * const dstdir = git_host_pathcat(mirror, directory);
+	struct dirent **namelist;
+	int count, copied = 0;
+
+	/* The mirror then holds everything listed, unless a copy failed or the listing did */
+	replica->namelist = NULL;
+	replica->count = 0;
+	if (count = scandir(srcdir, &namelist, git_host_replicate_filter, alphasort), count <= 0) {
+		replica->complete = count == 0 || errno == ENOENT;
+		free(dstdir);
+		free(srcdir);
+		return 0;
+	}
+	replica->namelist = namelist;
+	replica->count = count;
+	replica->complete = 1;
+
+	mkdir(dstdir, 0777);
+
+	const int srcdirfd = open(srcdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	const int dstdirfd = open(dstdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (srcdirfd < 0 || dstdirfd < 0) {
+		err(EXIT_FAILURE, "Unable to replicate %s", srcdir);
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < count; i++) {
+			const char * const extension = strrchr(namelist[i]->d_name, '.');
+			const int isindex = extension != NULL && strcmp(extension, ".idx") == 0;
+
+			if (isindex == pass && faccessat(dstdirfd, namelist[i]->d_name, F_OK, 0) != 0) {
+				if (git_host_copy_file(srcdirfd, dstdirfd, namelist[i]->d_name) == 0) {
+					copied++;
+				} else {
+					replica->complete = 0;
+				}
+			}
+		}
+	}
+
+	close(dstdirfd);
+	close(srcdirfd);
+	free(dstdir);
+	free(srcdir);
+
+	return copied;
+}
+
+static int
+git_host_replicate_prune(const char *mirror, const char *directory, struct git_host_replica *replica) {
+	/*
+	 * Removes the objects of the mirror which were not listed in the repository when copying, indexes first.
+	 * Objects gone from the repository since, say repacked, are kept: the mirror may not have their new pack yet.
+	 */
+	char * const dstdir = git_host_pathcat(mirror, directory);
+	struct dirent **namelist;
+	int count, pruned = 0;
+
+	if (replica->complete && (count = scandir(dstdir, &namelist, git_host_replicate_filter, alphasort), count > 0)) {
+		const int dstdirfd = open(dstdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		for (int pass = 0; pass < 2 && dstdirfd >= 0; pass++) {
+			for (int i = 0; i < count; i++) {
+				const char * const extension = strrchr(namelist[i]->d_name, '.');
+				const int isindex = extension != NULL && strcmp(extension, ".idx") == 0;
+
+				if (isindex != pass && bsearch(&namelist[i], replica->namelist, replica->count,
+					sizeof (*replica->namelist), git_host_replicate_compare) == NULL
+					&& unlinkat(dstdirfd, namelist[i]->d_name, 0) == 0) {
+					pruned++;
+				}
+			}
+		}
+
+		if (dstdirfd >= 0) {
+			close(dstdirfd);
+		}
+
+		for (int i = 0; i < count; i++) {
+			free(namelist[i]);
+		}
+		free(namelist);
+	}
+
+	for (int i = 0; i < replica->count; i++) {
+		free(replica->namelist[i]);
+	}
+	free(replica->namelist);
+	free(dstdir);
+
+	return pruned;
+}
+
+static int
+git_host_sync_refs(const char *gitdir, char **refs, int count) {
+	/* Updates the refs of a repository which differ from refs, in a single transaction */
+	char **mirrored, *gitdirarg;
+	const int mirroredcount = git_host_refs(gitdir, &mirrored);
+	int fds[2], updates = 0, i = 0, j = 0;
+
+	if (mirroredcount < 0) {
+		return -1;
+	}
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", gitdir) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	char * const argv[] = { "git", gitdirarg, "update-ref", "--stdin", NULL };
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), argv, fds[0], -1, -1);
+	FILE * const filep = fdopen(fds[1], "w");
+
+	close(fds[0]);
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	while (i < count || j < mirroredcount) {
+		const int order = i == count ? 1 : j == mirroredcount ? -1
+			: git_host_refs_compare(&refs[i], &mirrored[j]);
+
+		if (order > 0) {
+			/* Only in the mirror */
+			fprintf(filep, "delete%s\n", strchr(mirrored[j++], ' '));
+			updates++;
+			continue;
+		}
+
+		if (order < 0 || strcmp(refs[i], mirrored[j]) != 0) {
+			const char * const ref = strchr(refs[i], ' ');
+
+			fprintf(filep, "update%s %.*s\n", ref, (int)(ref - refs[i]), refs[i]);
+			updates++;
+		}
+
+		j += order == 0;
+		i++;
+	}
+
+	fclose(filep);
+	free(gitdirarg);
+
+	for (int k = 0; k < mirroredcount; k++) {
+		free(mirrored[k]);
+	}
+	free(mirrored);
+
+	return git_host_wait(pid) == 0 ? updates : -1;
+}
+
+static void
+git_host_replicate_owner(const char *path) {
+	/* Creates the owner directory of a repository in the mirror */
+	const size_t ownerlen = strchr(path, '/') - path;
+	char owner[ownerlen + 1];
+
+	memcpy(owner, path, ownerlen);
+	owner[ownerlen] = '\0';
+
+	char * const ownerdir = git_host_pathcat(CONFIG_GIT_REPLICATION_MIRROR, owner);
+	mkdir(ownerdir, 0777);
+	free(ownerdir);
+}
+
+static int
+git_host_replicate_hibernated(const char *path, const char *repository, const char *mirror, const struct stat *st) {
+	/*
+	 * A hibernated repository only changes once thawed, and its archive is self-contained, so the archive is
+	 * copied as is, and only if the mirror doesn't already hold it. The archive replaces a mirrored repository.
+	 */
+	struct stat mirrored;
+
+	if (stat(mirror, &mirrored) == 0 && S_ISREG(mirrored.st_mode) && mirrored.st_size == st->st_size
+		&& mirrored.st_mtim.tv_sec == st->st_mtim.tv_sec && mirrored.st_mtim.tv_nsec == st->st_mtim.tv_nsec) {
+		printf("%s hibernated\n", path);
+		return 0;
+	}
+
+	git_host_replicate_owner(path);
+
+	/* Copied under its own name in a staging directory, and moved in place from there once complete */
+	char * const source = xstrdup(repository);
+	char * const staging = git_host_sibling(mirror, "hibernated");
+	const char * const name = strrchr(repository, '/') + 1;
+
+	*strrchr(source, '/') = '\0';
+	git_host_tree_remove(AT_FDCWD, staging);
+
+	const int srcdirfd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	const int stagingfd = mkdir(staging, 0777) == 0 ? open(staging, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+	if (srcdirfd < 0 || stagingfd < 0) {
+		err(EXIT_FAILURE, "Unable to replicate '%s'", path);
+	}
+
+	const int ret = git_host_copy_file(srcdirfd, stagingfd, name);
+	close(stagingfd);
+	close(srcdirfd);
+
+	if (ret == 0) {
+		char * const archive = git_host_pathcat(staging, name);
+
+		if (renameat2(AT_FDCWD, archive, AT_FDCWD, mirror, RENAME_EXCHANGE) != 0
+			&& (errno != ENOENT || rename(archive, mirror) != 0)) {
+			err(EXIT_FAILURE, "Unable to replicate '%s'", path);
+		}
+		free(archive);
+
+		printf("%s hibernated\n", path);
+	} else {
+		/* Thawed since listed, replicated as a repository with the push which follows */
+		printf("%s thawed\n", path);
+	}
+
+	git_host_tree_remove(AT_FDCWD, staging);
+	free(staging);
+	free(source);
+
+	return 0;
+}
+
+static int
+git_host_replicate_repository(const char *path, const char *repository) {
+	/* Refs are listed before copying objects, so that every object they reference gets copied */
+	char * const mirror = git_host_pathcat(CONFIG_GIT_REPLICATION_MIRROR, path);
+	char **refs, head[PATH_MAX], mirrorhead[PATH_MAX], *gitdirarg, *mirrorarg, directories[257][16];
+	struct git_host_replica replicas[257];
+	int count, objects = 0, pruned = 0, updates;
+	struct stat st;
+
+	/* Deleted or renamed since updated, the mirror goes too, a repository is never missing while thawed or migrated */
+	if (stat(repository, &st) != 0 && errno == ENOENT) {
+		if (stat(mirror, &st) == 0) {
+			git_host_tree_remove(AT_FDCWD, mirror);
+			printf("%s removed\n", path);
+		}
+		free(mirror);
+		return 0;
+	}
+
+	if (stat(repository, &st) == 0 && S_ISREG(st.st_mode)) {
+		const int ret = git_host_replicate_hibernated(path, repository, mirror, &st);
+
+		free(mirror);
+		return ret;
+	}
+
+	if (count = git_host_refs(repository, &refs), count < 0) {
+		warnx("Unable to list refs of '%s'", path);
+		free(mirror);
+		return -1;
+	}
+
+	/* The archive of a repository since thawed is replaced by a mirrored repository again */
+	if (stat(mirror, &st) == 0 && S_ISREG(st.st_mode)) {
+		unlink(mirror);
+	}
+
+	if (stat(mirror, &st) != 0) {
+		git_host_replicate_owner(path);
+
+		char * const initargv[] = { "git", "init", "--bare", "-q", mirror, NULL };
+		if (git_host_wait(git_host_spawn(git_host_execpath("git"), initargv, -1, -1, -1)) != 0) {
+			errx(EXIT_FAILURE, "Unable to create mirror '%s'", mirror);
+		}
+	}
+
+	/* Loose objects first: git packs them before removing them, so the pack listed afterwards has those which vanished */
+	for (unsigned int i = 0; i <= 256; i++) {
+		snprintf(directories[i], sizeof (*directories), i < 256 ? "objects/%02x" : "objects/pack", i);
+		objects += git_host_replicate_objects(repository, mirror, directories[i], &replicas[i]);
+	}
+
+	updates = git_host_sync_refs(mirror, refs, count);
+
+	/* Once the refs match, objects packed or pruned by the repository are dropped from the mirror */
+	for (unsigned int i = 0; i <= 256; i++) {
+		replicas[i].complete = replicas[i].complete && updates >= 0;
+		pruned += git_host_replicate_prune(mirror, directories[i], &replicas[i]);
+	}
+
+	for (int i = 0; i < count; i++) {
+		free(refs[i]);
+	}
+	free(refs);
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", repository) < 0 || asprintf(&mirrorarg, "--git-dir=%s", mirror) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	char * const headargv[] = { "git", gitdirarg, "symbolic-ref", "-q", "HEAD", NULL };
+	char * const mirrorheadargv[] = { "git", mirrorarg, "symbolic-ref", "-q", "HEAD", NULL };
+	if (git_host_capture(headargv, head, sizeof (head)) == 0
+		&& git_host_capture(mirrorheadargv, mirrorhead, sizeof (mirrorhead)) == 0 && strcmp(head, mirrorhead) != 0) {
+		char * const setheadargv[] = { "git", mirrorarg, "symbolic-ref", "HEAD", head, NULL };
+
+		git_host_capture(setheadargv, mirrorhead, sizeof (mirrorhead));
+	}
+
+	free(mirrorarg);
+	free(gitdirarg);
+	free(mirror);
+
+	if (updates < 0) {
+		warnx("Unable to update refs of the mirror of '%s'", path);
+		return -1;
+	}
+
+	printf("%s %d %d %d\n", path, objects, updates, pruned);
+
+	return 0;
+}
+
+struct git_host_replication {
+	uint64_t expected;
+	int gap;
+	char **paths;
+	int count;
+	long long oldest;
+};
+
+static int
+git_host_replication_collect(uint64_t sequence, const char *payload, size_t length, void *data) {
+	/* Batches updates per repository, only remembering which repositories changed */
+	struct git_host_replication * const replication = data;
+	const char * const end = memchr(payload, ' ', length);
+	const size_t pathlen = end != NULL ? end - payload : length;
+	int i = 0;
+
+	/* Records removed by retention before being replicated */
+	if (sequence != replication->expected) {
+		replication->gap = 1;
+	}
+	replication->expected = sequence + 1;
+
+	if (replication->count == 0) {
+		const char *timestamp = payload + length;
+
+		while (timestamp > payload && timestamp[-1] != ' ') {
+			timestamp--;
+		}
+		replication->oldest = strtoll(timestamp, NULL, 10);
+	}
+
+	while (i < replication->count
+		&& (strncmp(replication->paths[i], payload, pathlen) != 0 || replication->paths[i][pathlen] != '\0')) {
+		i++;
+	}
+
+	if (i == replication->count) {
+		char * const path = strndup(payload, pathlen);
+
+		if (path == NULL) {
+			err(EXIT_FAILURE, "strndup");
+		}
+		git_host_array_push(path, &replication->count, &replication->paths);
+	}
+
+	return 0;
+}
+
+struct git_host_replication_checkpoint {
+	uint64_t next;
+	long long last;
+};
+
+static struct git_host_replication_checkpoint
+git_host_replication_checkpoint_read(void) {
+	/* The checkpoint is the next sequence to replicate, and the time of the last replication */
+	struct git_host_replication_checkpoint checkpoint = { .next = 0, .last = 0 };
+	FILE * const filep = fopen(CONFIG_GIT_HOME_REPLICATION, "r");
+
+	if (filep != NULL) {
+		unsigned long long next;
+
+		if (fscanf(filep, "%llu %lld", &next, &checkpoint.last) == 2) {
+			checkpoint.next = next;
+		}
+		fclose(filep);
+	} else if (errno != ENOENT) {
+		err(EXIT_FAILURE, "fopen "CONFIG_GIT_HOME_REPLICATION);
+	}
+
+	return checkpoint;
+}
+
+static void
+git_host_replication_checkpoint_write(const struct git_host_replication_checkpoint *checkpoint) {
+	FILE * const filep = fopen(CONFIG_GIT_HOME_REPLICATION".tmp", "w");
+
+	if (filep == NULL || fprintf(filep, "%llu %lld\n", (unsigned long long)checkpoint->next, checkpoint->last) < 0
+		|| fflush(filep) != 0 || fsync(fileno(filep)) != 0 || fclose(filep) != 0
+		|| rename(CONFIG_GIT_HOME_REPLICATION".tmp", CONFIG_GIT_HOME_REPLICATION) != 0) {
+		err(EXIT_FAILURE, "Unable to write "CONFIG_GIT_HOME_REPLICATION);
+	}
+}
+
+static void
+git_host_maintenance_replicate_repository(const char *path, const char *repository, void *data) {
+	int * const failures = data;
+
+	if (git_host_replicate_repository(path, repository) != 0) {
+		++*failures;
+	}
+}
+
+static void noreturn
+git_host_maintenance_replicate(int argc, char **argv) {
+	/* Follows the journal, replicating each batch of updated repositories to the mirror */
+	int once = 0, full = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--once") == 0) {
+			once = 1;
+		} else if (strcmp(argv[i], "--full") == 0) {
+			full = 1;
+		} else {
+			fprintf(stderr, "usage: %s [--once] [--full]\n", *argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (*CONFIG_GIT_REPLICATION_MIRROR == '\0') {
+		errx(EXIT_FAILURE, "No replication mirror configured");
+	}
+
+	/* Watch before reading, so a push landing in between still wakes us up */
+	mkdir(CONFIG_GIT_HOME_JOURNAL, 0777);
+
+	const int inotifyfd = inotify_init1(IN_CLOEXEC);
+	if (inotifyfd < 0 || inotify_add_watch(inotifyfd, CONFIG_GIT_HOME_JOURNAL, IN_ATTRIB | IN_CREATE) < 0) {
+		err(EXIT_FAILURE, "inotify "CONFIG_GIT_HOME_JOURNAL);
+	}
+
+	struct git_host_replication_checkpoint checkpoint = git_host_replication_checkpoint_read();
+
+	/* Without a checkpoint, everything is copied once, updates during the copy are replayed */
+	if (checkpoint.next == 0) {
+		checkpoint.next = git_host_journal_next();
+		full = 1;
+	}
+
+	for (;;) {
+		struct git_host_replication replication = { .expected = checkpoint.next, .gap = 0, .paths = NULL, .count = 0 };
+		uint64_t next = git_host_journal_read(checkpoint.next, git_host_replication_collect, &replication);
+		int failures = 0;
+
+		if (!full && replication.count == 0) {
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+			if (once) {
+				exit(EXIT_SUCCESS);
+			}
+
+			if (read(inotifyfd, events, sizeof (events)) < 0 && errno != EINTR) {
+				err(EXIT_FAILURE, "read inotify");
+			}
+			continue;
+		}
+
+		/* Let bursts coalesce, but never beyond the delay after the oldest pending update */
+		const long long delay = replication.oldest + CONFIG_GIT_REPLICATION_DELAY - time(NULL);
+		if (!once && !full && delay > 0) {
+			sleep(delay);
+			next = git_host_journal_read(next, git_host_replication_collect, &replication);
+		}
+
+		if (full || replication.gap) {
+			git_host_foreach_repository(git_host_maintenance_replicate_repository, &failures, 1);
+		} else {
+			for (int i = 0; i < replication.count; i++) {
+				char * const repository = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, replication.paths[i]);
+
+				git_host_maintenance_replicate_repository(replication.paths[i], repository, &failures);
+				free(repository);
+			}
+		}
+
+		for (int i = 0; i < replication.count; i++) {
+			free(replication.paths[i]);
+		}
+		free(replication.paths);
+		fflush(stdout);
+
+		if (failures != 0) {
+			warnx("Unable to replicate %d repositories, retrying", failures);
+			if (once) {
+				exit(EXIT_FAILURE);
+			}
+			sleep(CONFIG_GIT_REPLICATION_DELAY);
+			continue;
+		}
+
+		checkpoint.next = next;
+		checkpoint.last = time(NULL);
+		git_host_replication_checkpoint_write(&checkpoint);
+		full = 0;
+	}
+}
+
+static void noreturn
+git_host_maintenance_stats(int argc, char **argv) {
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	const uint64_t next = git_host_journal_next();
+
+	printf("journal.next %llu\n", (unsigned long long)next);
+
+	const int hibernationfd = open(CONFIG_GIT_HOME_HIBERNATION, O_RDONLY | O_CLOEXEC);
+	struct git_host_hibernation_stats hibernation = { 0 };
+
+	if (hibernationfd >= 0) {
+		if (pread(hibernationfd, &hibernation, sizeof (hibernation), 0) != sizeof (hibernation)) {
+			memset(&hibernation, 0, sizeof (hibernation));
+		}
+		close(hibernationfd);
+	}
+
+	printf("hibernation.thaws %llu\n", (unsigned long long)hibernation.thaws);
+	printf("hibernation.thaw.average %llu\n",
+		hibernation.thaws != 0 ? (unsigned long long)(hibernation.total / hibernation.thaws) : 0ull);
+	printf("hibernation.thaw.max %llu\n", (unsigned long long)hibernation.max);
+
+	if (*CONFIG_GIT_REPLICATION_MIRROR != '\0') {
+		const struct git_host_replication_checkpoint checkpoint = git_host_replication_checkpoint_read();
+		struct git_host_replication replication = { .expected = checkpoint.next, .gap = 0, .paths = NULL, .count = 0 };
+
+		/* Lag is the age of the oldest update not yet replicated */
+		if (checkpoint.next != 0) {
+			git_host_journal_read(checkpoint.next, git_host_replication_collect, &replication);
+		}
+
+		printf("replication.checkpoint %llu\n", (unsigned long long)checkpoint.next);
+		printf("replication.pending %llu\n", checkpoint.next != 0 ? (unsigned long long)(next - checkpoint.next) : 0ull);
+		printf("replication.repositories %d\n", replication.count);
+		printf("replication.lag %lld\n", replication.count != 0 ? (long long)time(NULL) - replication.oldest : 0ll);
+		printf("replication.last %lld\n", checkpoint.last);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+struct git_host_backup {
+	const char *destination;
+	unsigned long long bandwidth;
+	int jobs;
+	int running;
+	int failures;
+};
+
+static int
+git_host_backup_filter(const struct dirent *entry) {
+	return strlen(entry->d_name) == 11 && strspn(entry->d_name, "0123456789") == 6
+		&& strcmp(entry->d_name + 6, ".refs") == 0;
+}
+
+static int
+git_host_backup_checkpoint(int dirfd, const char *name, char ***refsp) {
+	/* Reads the refs of a checkpoint, returns their count */
+	const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	FILE * const filep = fd >= 0 ? fdopen(fd, "r") : NULL;
+	char *line = NULL;
+	size_t n = 0;
+	int count = 0;
+
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "open %s", name);
+	}
+
+	*refsp = NULL;
+	while (getline(&line, &n, filep) >= 0) {
+		line[strcspn(line, "\n")] = '\0';
+		git_host_array_push(xstrdup(line), &count, refsp);
+	}
+	free(line);
+	fclose(filep);
+
+	return count;
+}
+
+static void
+git_host_backup_write(int dirfd, const char *name, char **lines, int count) {
+	/* Lines only appear under name once durable */
+	char temporary[strlen(name) + 5];
+
+	snprintf(temporary, sizeof (temporary), "%s.tmp", name);
+
+	const int fd = openat(dirfd, temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	FILE * const filep = fd >= 0 ? fdopen(fd, "w") : NULL;
+
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "open %s", temporary);
+	}
+
+	for (int i = 0; i < count; i++) {
+		fprintf(filep, "%s\n", lines[i]);
+	}
+
+	if (fflush(filep) != 0 || fsync(fd) != 0 || fclose(filep) != 0
+		|| renameat(dirfd, temporary, dirfd, name) != 0) {
+		err(EXIT_FAILURE, "Unable to write %s", name);
+	}
+}
+
+static pid_t
+git_host_backup_spawn(char * const argv[], char **included, int includedcount, char **excluded, int count, int out) {
+	/* Runs the git command argv, including and excluding the objects reachable from <oid> <ref> lines through its --stdin */
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), argv, fds[0], out, -1);
+	FILE * const filep = fdopen(fds[1], "w");
+
+	close(fds[0]);
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	for (int i = 0; i < includedcount; i++) {
+		fprintf(filep, "%.*s\n", (int)strcspn(included[i], " "), included[i]);
+	}
+	for (int i = 0; i < count; i++) {
+		fprintf(filep, "^%.*s\n", (int)strcspn(excluded[i], " "), excluded[i]);
+	}
+	fclose(filep);
+
+	return pid;
+}
+
+static void
+git_host_backup_copy(int in, int out, unsigned long long bandwidth) {
+	/* Copies in to out, sleeping as needed to stay within bandwidth bytes per second, if any */
+	struct timespec start;
+	unsigned long long total = 0;
+	char buffer[65536];
+	ssize_t readed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (readed = read(in, buffer, sizeof (buffer)), readed != 0) {
+		if (readed < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "read");
+		}
+
+		git_host_write_full(out, buffer, readed);
+		total += readed;
+
+		if (bandwidth != 0) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			const double ahead = (double)total / bandwidth
+				- ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+			if (ahead > 0) {
+				const struct timespec delay = { .tv_sec = ahead, .tv_nsec = (ahead - (time_t)ahead) * 1e9 };
+
+				nanosleep(&delay, NULL);
+			}
+		}
+	}
+}
+
+/* Archive of a hibernated repository, superseding the checkpoints until it is thawed and backed up again */
+#define GIT_HOST_BACKUP_HIBERNATED "hibernated"
+
+static int
+git_host_backup_hibernated(const char *path, int fd, const struct stat *st, int dirfd, const struct git_host_backup *backup) {
+	/* The archive is self-contained and only changes once thawed, it is copied unless the backup already holds it */
+	const struct timespec times[] = { st->st_atim, st->st_mtim };
+	struct stat backedup;
+
+	if (fstatat(dirfd, GIT_HOST_BACKUP_HIBERNATED, &backedup, 0) == 0 && backedup.st_size == st->st_size
+		&& backedup.st_mtim.tv_sec == st->st_mtim.tv_sec && backedup.st_mtim.tv_nsec == st->st_mtim.tv_nsec) {
+		return 0;
+	}
+
+	const int out = openat(dirfd, GIT_HOST_BACKUP_HIBERNATED".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) {
+		err(EXIT_FAILURE, "Unable to back up '%s'", path);
+	}
+
+	git_host_backup_copy(fd, out, backup->bandwidth);
+
+	if (futimens(out, times) != 0 || fsync(out) != 0
+		|| renameat(dirfd, GIT_HOST_BACKUP_HIBERNATED".tmp", dirfd, GIT_HOST_BACKUP_HIBERNATED) != 0) {
+		warn("Unable to back up '%s'", path);
+		close(out);
+		return -1;
+	}
+	close(out);
+
+	printf("%s hibernated\n", path);
+
+	return 0;
+}
+
+static int
+git_host_backup_repository(const char *path, const char *repository, const struct git_host_backup *backup) {
+	/*
+	 * Backups of a repository are a chain of checkpoints, NNNNNN.refs lists the refs at the time of NNNNNN.bundle,
+	 * which only contains the objects not reachable from the previous checkpoint, and is absent if there were none.
+	 * A checkpoint is only written once its bundle is durable, an interrupted backup is simply redone.
+	 */
+	char * const directory = git_host_pathcat(backup->destination, path);
+	char **previous = NULL, **refs, **changed = NULL, *gitdirarg, name[16], head[PATH_MAX], buffer[4096];
+	int previouscount = 0, refscount, changedcount = 0, ret = -1;
+	unsigned int last = 0;
+	struct dirent **namelist;
+	ssize_t readed, total = 0;
+
+	*strchr(directory + strlen(backup->destination) + 1, '/') = '\0';
+	mkdir(directory, 0777);
+	directory[strlen(directory)] = '/';
+	mkdir(directory, 0777);
+
+	const int dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		err(EXIT_FAILURE, "open %s", directory);
+	}
+
+	/* Checked once open, a thaw replaces the archive but can't change it under us */
+	const int fd = open(repository, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		ret = git_host_backup_hibernated(path, fd, &st, dirfd, backup);
+		close(fd);
+		close(dirfd);
+		free(directory);
+		return ret;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	const int count = scandirat(dirfd, ".", &namelist, git_host_backup_filter, alphasort);
+	if (count > 0) {
+		last = strtoul(namelist[count - 1]->d_name, NULL, 10);
+		previouscount = git_host_backup_checkpoint(dirfd, namelist[count - 1]->d_name, &previous);
+	}
+
+	for (int i = 0; i < count; i++) {
+		free(namelist[i]);
+	}
+	if (count >= 0) {
+		free(namelist);
+	}
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", repository) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	if (refscount = git_host_refs(repository, &refs), refscount < 0) {
+		warnx("Unable to list refs of '%s'", path);
+		goto end;
+	}
+
+	int unchanged = count > 0 && refscount == previouscount;
+	for (int i = 0; unchanged && i < refscount; i++) {
+		unchanged = strcmp(refs[i], previous[i]) == 0;
+	}
+
+	if (unchanged) {
+		ret = 0;
+		goto end;
+	}
+
+	/* Only new or moved refs may need a bundle, say annotated tags of known commits, both lists are ordered by ref */
+	for (int i = 0, j = 0; i < refscount; i++) {
+		while (j < previouscount && git_host_refs_compare(&refs[i], &previous[j]) > 0) {
+			j++;
+		}
+
+		if (j == previouscount || strcmp(refs[i], previous[j]) != 0) {
+			git_host_array_push(refs[i], &changedcount, &changed);
+		}
+	}
+
+	/*
+	 * Those moved to known commits don't, git refuses empty bundles anyway. Previous tips since pruned are ignored,
+	 * their objects are in earlier bundles, though bundled again. The output is drained, only its presence matters.
+	 */
+	int fds[2];
+	if (changedcount != 0 && pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	if (changedcount != 0) {
+		char * const revlistargv[] = { "git", gitdirarg, "rev-list", "--objects", "--max-count=1", "--ignore-missing", "--stdin", NULL };
+		const pid_t revlistpid = git_host_backup_spawn(revlistargv, changed, changedcount, previous, previouscount, fds[1]);
+
+		close(fds[1]);
+		while (readed = read(fds[0], buffer, sizeof (buffer)), readed > 0 || (readed < 0 && errno == EINTR)) {
+			total += readed > 0 ? readed : 0;
+		}
+		close(fds[0]);
+
+		if (git_host_wait(revlistpid) != 0 || readed < 0) {
+			warnx("Unable to list new objects of '%s'", path);
+			goto end;
+		}
+	}
+
+	if (total != 0) {
+		snprintf(name, sizeof (name), "%06u.bundle", last + 1);
+
+		const int out = openat(dirfd, "bundle.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (out < 0 || pipe2(fds, O_CLOEXEC) != 0) {
+			err(EXIT_FAILURE, "Unable to create %s/%s", directory, name);
+		}
+
+		char * const bundleargv[] = { "git", gitdirarg, "bundle", "create", "-", "--all", "--ignore-missing", "--stdin", NULL };
+		const pid_t bundlepid = git_host_backup_spawn(bundleargv, NULL, 0, previous, previouscount, fds[1]);
+
+		close(fds[1]);
+		git_host_backup_copy(fds[0], out, backup->bandwidth);
+		close(fds[0]);
+
+		if (git_host_wait(bundlepid) != 0 || fsync(out) != 0 || renameat(dirfd, "bundle.tmp", dirfd, name) != 0) {
+			warnx("Unable to bundle '%s'", path);
+			close(out);
+			goto end;
+		}
+		close(out);
+
+		/* Refs may have moved since listed, the bundle's own are consistent with its contents */
+		char * const bundle = git_host_pathcat(directory, name);
+		char * const listheadsargv[] = { "git", "bundle", "list-heads", bundle, NULL };
+
+		for (int i = 0; i < refscount; i++) {
+			free(refs[i]);
+		}
+		free(refs);
+
+		refscount = git_host_refs_read(listheadsargv, &refs);
+		free(bundle);
+
+		if (refscount < 0) {
+			warnx("Unable to list refs of bundle '%s'", name);
+			goto end;
+		}
+	}
+
+	char * const headargv[] = { "git", gitdirarg, "symbolic-ref", "-q", "HEAD", NULL };
+	if (git_host_capture(headargv, head, sizeof (head)) == 0) {
+		char *lines[] = { head };
+
+		git_host_backup_write(dirfd, "HEAD", lines, 1);
+	}
+
+	snprintf(name, sizeof (name), "%06u.refs", last + 1);
+	git_host_backup_write(dirfd, name, refs, refscount);
+
+	printf("%s %06u\n", path, last + 1);
+	ret = 0;
+
+	for (int i = 0; i < refscount; i++) {
+		free(refs[i]);
+	}
+	free(refs);
+
+end:
+	/* Once thawed, the checkpoints hold the repository again */
+	if (ret == 0 && unlinkat(dirfd, GIT_HOST_BACKUP_HIBERNATED, 0) != 0 && errno != ENOENT) {
+		warn("Unable to remove the archive backed up for '%s'", path);
+	}
+
+	for (int i = 0; i < previouscount; i++) {
+		free(previous[i]);
+	}
+	free(previous);
+	free(changed);
+	free(gitdirarg);
+	close(dirfd);
+	free(directory);
+
+	return ret;
+}
+
+static void
+git_host_reap(int *runningp, int *failuresp) {
+	/* Waits for one of the jobs forked by a maintenance command, counting it as failed if it didn't succeed */
+	int wstatus;
+
+	while (wait(&wstatus) < 0) {
+		if (errno != EINTR) {
+			err(EXIT_FAILURE, "wait");
+		}
+	}
+
+	if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+		++*failuresp;
+	}
+	--*runningp;
+}
+
+static void
+git_host_maintenance_backup_repository(const char *path, const char *repository, void *data) {
+	struct git_host_backup * const backup = data;
+
+	if (backup->running == backup->jobs) {
+		git_host_reap(&backup->running, &backup->failures);
+	}
+
+	fflush(stdout);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		exit(git_host_backup_repository(path, repository, backup) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	backup->running++;
+}
+
+static void noreturn
+git_host_maintenance_backup(int argc, char **argv) {
+	struct git_host_backup backup = {
+		.destination = NULL,
+		.bandwidth = 0,
+		.jobs = CONFIG_GIT_BACKUP_JOBS,
+		.running = 0,
+		.failures = 0,
+	};
+	char *end;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			backup.jobs = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || backup.jobs <= 0) {
+				errx(EXIT_FAILURE, "Invalid number of jobs '%s'", argv[i]);
+			}
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			if (git_host_parse_size(argv[++i], &backup.bandwidth) != 0) {
+				errx(EXIT_FAILURE, "Invalid bandwidth '%s'", argv[i]);
+			}
+		} else if (*argv[i] != '-' && backup.destination == NULL) {
+			backup.destination = argv[i];
+		} else {
+			backup.destination = NULL;
+			break;
+		}
+	}
+
+	if (backup.destination == NULL) {
+		fprintf(stderr, "usage: %s [-j <jobs>] [-b <bytes per second>] <destination>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The bandwidth budget is shared among jobs */
+	backup.bandwidth /= backup.jobs;
+	mkdir(backup.destination, 0777);
+
+	git_host_foreach_repository(git_host_maintenance_backup_repository, &backup, 1);
+
+	while (backup.running != 0) {
+		git_host_reap(&backup.running, &backup.failures);
+	}
+
+	if (backup.failures != 0) {
+		errx(EXIT_FAILURE, "Unable to back up %d repositories", backup.failures);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static int
+git_host_restore_repository(const char *destination, const char *path) {
+	/* Replays the chain of bundles into a new repository, then sets its refs to the last checkpoint's */
+	char * const directory = git_host_pathcat(destination, path);
+	char * const repository = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path);
+	struct dirent **namelist;
+	char **refs, *gitdirarg;
+	struct stat st;
+	int ret = -1;
+
+	const int dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	const int count = dirfd >= 0 ? scandirat(dirfd, ".", &namelist, git_host_backup_filter, alphasort) : -1;
+	const int archivefd = dirfd >= 0 ? openat(dirfd, GIT_HOST_BACKUP_HIBERNATED, O_RDONLY | O_CLOEXEC) : -1;
+
+	if (count <= 0 && archivefd < 0) {
+		warnx("No backup of '%s'", path);
+		goto end;
+	}
+
+	if (stat(repository, &st) == 0 || errno != ENOENT) {
+		warnx("Repository '%s' already exists", path);
+		goto end;
+	}
+
+	char * const ownerdir = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path);
+	*strrchr(ownerdir, '/') = '\0';
+	mkdir(ownerdir, 0777);
+	free(ownerdir);
+
+	/* A repository backed up hibernated is restored hibernated, and thawed by its first session */
+	if (archivefd >= 0) {
+		char * const restoring = git_host_sibling(repository, "restoring");
+		const int out = open(restoring, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (out < 0) {
+			err(EXIT_FAILURE, "Unable to restore '%s'", path);
+		}
+
+		git_host_backup_copy(archivefd, out, 0);
+
+		if (fsync(out) != 0 || renameat2(AT_FDCWD, restoring, AT_FDCWD, repository, RENAME_NOREPLACE) != 0) {
+			warn("Unable to restore '%s'", path);
+			unlink(restoring);
+		} else {
+			printf("%s hibernated\n", path);
+			ret = 0;
+		}
+
+		close(out);
+		free(restoring);
+		goto end;
+	}
+
+	char * const initargv[] = { "git", "init", "--bare", "-q", repository, NULL };
+	if (git_host_wait(git_host_spawn(git_host_execpath("git"), initargv, -1, -1, -1)) != 0) {
+		warnx("Unable to create '%s'", path);
+		goto end;
+	}
+	git_host_install_hooks(repository);
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", repository) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	const int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	ret = 0;
+
+	for (int i = 0; i < count && ret == 0; i++) {
+		char name[16];
+
+		snprintf(name, sizeof (name), "%.6s.bundle", namelist[i]->d_name);
+		if (faccessat(dirfd, name, F_OK, 0) == 0) {
+			char * const bundle = git_host_pathcat(directory, name);
+			char * const unbundleargv[] = { "git", gitdirarg, "bundle", "unbundle", bundle, NULL };
+
+			if (git_host_wait(git_host_spawn(git_host_execpath("git"), unbundleargv, -1, devnull, -1)) != 0) {
+				warnx("Unable to unbundle '%s'", bundle);
+				ret = -1;
+			}
+			free(bundle);
+		}
+	}
+	close(devnull);
+
+	const int refscount = git_host_backup_checkpoint(dirfd, namelist[count - 1]->d_name, &refs);
+	if (ret == 0 && git_host_sync_refs(repository, refs, refscount) < 0) {
+		warnx("Unable to restore refs of '%s'", path);
+		ret = -1;
+	}
+
+	for (int i = 0; i < refscount; i++) {
+		free(refs[i]);
+	}
+	free(refs);
+
+	char **head;
+	if (faccessat(dirfd, "HEAD", F_OK, 0) == 0 && git_host_backup_checkpoint(dirfd, "HEAD", &head) == 1) {
+		char * const headargv[] = { "git", gitdirarg, "symbolic-ref", "HEAD", *head, NULL };
+
+		git_host_wait(git_host_spawn(git_host_execpath("git"), headargv, -1, -1, -1));
+		free(*head);
+		free(head);
+	}
+
+	free(gitdirarg);
+
+	if (ret == 0) {
+		printf("%s %.6s\n", path, namelist[count - 1]->d_name);
+	}
+
+end:
+	for (int i = 0; i < count; i++) {
+		free(namelist[i]);
+	}
+	if (count >= 0) {
+		free(namelist);
+	}
+	if (archivefd >= 0) {
+		close(archivefd);
+	}
+	if (dirfd >= 0) {
+		close(dirfd);
+	}
+	free(repository);
+	free(directory);
+
+	return ret;
+}
+
+static void noreturn
+git_host_maintenance_restore(int argc, char **argv) {
+	int failures = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <destination> <owner>/<repo>...\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 2; i < argc; i++) {
+		char * const path = xstrdup(argv[i]);
+
+		if (git_host_normalize_path(path) != 0 || git_host_check_repository_shape(path) != 0) {
+			warnx("Invalid repository path '%s'", argv[i]);
+			failures++;
+		} else if (git_host_restore_repository(argv[1], path) != 0) {
+			failures++;
+		}
+
+		free(path);
+	}
+
+	if (failures != 0) {
+		errx(EXIT_FAILURE, "Unable to restore %d repositories", failures);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+struct git_host_tier {
+	char *name;
+	char *root;
+};
+
+static int
+git_host_tiers(struct git_host_tier **tiersp) {
+	/* Lines of the tiers file are `<name> <root>`, fastest first, returns how many are configured */
+	FILE * const filep = fopen(CONFIG_GIT_HOME_TIERS, "r");
+	struct git_host_tier *tiers = NULL;
+	char *line = NULL;
+	size_t n = 0;
+	int count = 0;
+
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "fopen "CONFIG_GIT_HOME_TIERS);
+		}
+		*tiersp = NULL;
+		return 0;
+	}
+
+	while (getline(&line, &n, filep) >= 0) {
+		char *saveptr;
+
+		line[strcspn(line, "#")] = '\0';
+
+		const char * const name = strtok_r(line, " \t\n", &saveptr);
+		const char * const root = strtok_r(NULL, " \t\n", &saveptr);
+
+		if (name == NULL) {
+			continue;
+		}
+
+		if (root == NULL) {
+			errx(EXIT_FAILURE, CONFIG_GIT_HOME_TIERS": Missing root for tier '%s'", name);
+		}
+
+		tiers = realloc(tiers, (count + 1) * sizeof (*tiers));
+		if (tiers == NULL) {
+			err(EXIT_FAILURE, "realloc");
+		}
+
+		tiers[count].name = xstrdup(name);
+		tiers[count].root = xstrdup(root);
+		count++;
+	}
+
+	free(line);
+	fclose(filep);
+
+	*tiersp = tiers;
+	return count;
+}
+
+static int
+git_host_tier_find(const struct git_host_tier *tiers, int count, const char *repository) {
+	/* Index of the tier the repository is stored in, -1 if none */
+	char * const location = realpath(repository, NULL);
+	int found = -1;
+
+	for (int i = 0; location != NULL && i < count && found < 0; i++) {
+		char * const root = realpath(tiers[i].root, NULL);
+
+		if (root != NULL) {
+			const size_t length = strlen(root);
+
+			if (strncmp(location, root, length) == 0 && location[length] == '/') {
+				found = i;
+			}
+			free(root);
+		}
+	}
+
+	free(location);
+
+	return found;
+}
+
+static void
+git_host_tree_sync(int srcdirfd, int dstdirfd) {
+	/*
+	 * Makes the destination a copy of the source, only copying files whose size or modification time differ,
+	 * so a second pass over a repository only copies what changed since the first. Push queues aren't copied.
+	 */
+	const int fd = openat(srcdirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR * const dirp = fd >= 0 ? fdopendir(fd) : NULL;
+	const struct dirent *entry;
+
+	if (dirp == NULL) {
+		err(EXIT_FAILURE, "opendir");
+	}
+
+	while (entry = readdir(dirp), entry != NULL) {
+		const char * const name = entry->d_name;
+		struct stat st, dst;
+
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, GIT_HOST_QUEUE) == 0
+			|| fstatat(srcdirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		const int exists = fstatat(dstdirfd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0;
+
+		if (S_ISDIR(st.st_mode)) {
+			if (exists && !S_ISDIR(dst.st_mode)) {
+				git_host_tree_remove(dstdirfd, name);
+			}
+
+			if (mkdirat(dstdirfd, name, st.st_mode & 07777) != 0 && errno != EEXIST) {
+				err(EXIT_FAILURE, "mkdir %s", name);
+			}
+
+			const int subsrcfd = openat(srcdirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			const int subdstfd = openat(dstdirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (subsrcfd >= 0 && subdstfd >= 0) {
+				git_host_tree_sync(subsrcfd, subdstfd);
+			} else if (subdstfd < 0) {
+				err(EXIT_FAILURE, "open %s", name);
+			}
+
+			close(subdstfd);
+			close(subsrcfd);
+		} else if (S_ISREG(st.st_mode)) {
+			if (exists && S_ISREG(dst.st_mode) && dst.st_size == st.st_size
+				&& dst.st_mtim.tv_sec == st.st_mtim.tv_sec && dst.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+				continue;
+			}
+
+			if (exists) {
+				git_host_tree_remove(dstdirfd, name);
+			}
+
+			git_host_copy_file(srcdirfd, dstdirfd, name);
+		} else if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX], dsttarget[PATH_MAX];
+			const ssize_t length = readlinkat(srcdirfd, name, target, sizeof (target) - 1);
+
+			if (length < 0) {
+				continue;
+			}
+			target[length] = '\0';
+
+			if (exists) {
+				const ssize_t dstlength = S_ISLNK(dst.st_mode)
+					? readlinkat(dstdirfd, name, dsttarget, sizeof (dsttarget) - 1) : -1;
+
+				if (dstlength == length && memcmp(target, dsttarget, length) == 0) {
+					continue;
+				}
+
+				git_host_tree_remove(dstdirfd, name);
+			}
+
+			if (symlinkat(target, dstdirfd, name) != 0) {
+				err(EXIT_FAILURE, "symlink %s", name);
+			}
+		}
+	}
+
+	closedir(dirp);
+
+	/* Then remove what was removed from the source since the last pass */
+	const int dstfd = openat(dstdirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR * const dstdirp = dstfd >= 0 ? fdopendir(dstfd) : NULL;
+
+	if (dstdirp == NULL) {
+		err(EXIT_FAILURE, "opendir");
+	}
+
+	while (entry = readdir(dstdirp), entry != NULL) {
+		struct stat st;
+
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0
+			&& fstatat(srcdirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 && errno == ENOENT) {
+			git_host_tree_remove(dstdirfd, entry->d_name);
+		}
+	}
+
+	closedir(dstdirp);
+}
+
+static char *
+git_host_tier_aside(const char *location) {
+	/* Name a previous copy is set aside under, next to it, until reaped by git_host_tier_reap() */
+	char suffix[32];
+
+	snprintf(suffix, sizeof (suffix), "%lld-%d.old", (long long)time(NULL), (int)getpid());
+
+	return git_host_sibling(location, suffix);
+}
+
+static void
+git_host_tier_exchange(const char *repository, const char *swap, const char *source) {
+	/*
+	 * Atomically exchanges the repositories entry with swap, which then holds the previous entry,
+	 * either a symbolic link or the repository itself, then sets the previous copy at source aside.
+	 */
+	struct stat st;
+
+	if (renameat2(AT_FDCWD, swap, AT_FDCWD, repository, RENAME_EXCHANGE) != 0) {
+		err(EXIT_FAILURE, "Unable to exchange %s with %s", repository, swap);
+	}
+
+	if (lstat(swap, &st) == 0 && S_ISLNK(st.st_mode)) {
+		char * const aside = git_host_tier_aside(source);
+
+		unlink(swap);
+		if (rename(source, aside) != 0) {
+			warn("rename %s", source);
+		}
+		free(aside);
+	} else {
+		char * const aside = git_host_tier_aside(repository);
+
+		if (rename(swap, aside) != 0) {
+			warn("rename %s", swap);
+		}
+		free(aside);
+	}
+}
+
+static int
+git_host_tier_migrate(const char *path, const char *repository, const struct git_host_tier *tier) {
+	/*
+	 * Migrates the repository to the tier while it is online. Most of it is copied first, then only what changed
+	 * meanwhile, while holding the push queue, before the entry in the repositories directory is atomically
+	 * exchanged with a symbolic link to the copy, or with the copy itself if the tier is the repositories directory.
+	 * The previous copy is only set aside, fetches still reading it can finish, see git_host_tier_reap().
+	 */
+	char * const source = realpath(repository, NULL);
+	char * const root = realpath(tier->root, NULL);
+	char * const home = realpath(CONFIG_GIT_HOME_REPOSITORIES, NULL);
+	int ret = -1;
+
+	if (source == NULL || root == NULL || home == NULL) {
+		warn("Unable to migrate '%s' to %s", path, tier->name);
+		goto out;
+	}
+
+	const char * const repo = strchr(path, '/') + 1;
+	const int inplace = strcmp(root, home) == 0;
+	char * const target = git_host_pathcat(root, path);
+	char * const ownerdir = git_host_pathcat(root, path);
+	ownerdir[strlen(root) + (repo - path)] = '\0';
+
+	char * const staging = git_host_sibling(target, "migrating");
+
+	if (strcmp(source, target) == 0) {
+		ret = 0; /* Already there */
+		goto out_target;
+	}
+
+	if (!inplace && access(target, F_OK) == 0) {
+		warnx("Unable to migrate '%s' to %s: %s already exists", path, tier->name, target);
+		goto out_target;
+	}
+
+	/* Leftovers of an interrupted migration are started over */
+	mkdir(ownerdir, 0777);
+	git_host_tree_remove(AT_FDCWD, staging);
+	if (mkdir(staging, 0777) != 0) {
+		warn("mkdir %s", staging);
+		goto out_target;
+	}
+
+	const int srcfd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	const int dstfd = open(staging, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat st;
+	if (srcfd < 0 || dstfd < 0 || fstat(srcfd, &st) != 0 || fchmod(dstfd, st.st_mode & 07777) != 0) {
+		err(EXIT_FAILURE, "Unable to migrate '%s'", path);
+	}
+
+	git_host_tree_sync(srcfd, dstfd);
+
+	const int queue = git_host_queue(repository, path);
+
+	git_host_tree_sync(srcfd, dstfd);
+
+	const char *swap = staging;
+	char *link = NULL;
+
+	if (!inplace) {
+		if (rename(staging, target) != 0) {
+			err(EXIT_FAILURE, "rename %s", staging);
+		}
+
+		link = git_host_sibling(repository, "link");
+
+		unlink(link);
+		if (symlink(target, link) != 0) {
+			err(EXIT_FAILURE, "symlink %s", link);
+		}
+		swap = link;
+	}
+
+	git_host_tier_exchange(repository, swap, source);
+
+	close(queue);
+	close(dstfd);
+	close(srcfd);
+	free(link);
+	ret = 0;
+
+out_target:
+	free(staging);
+	free(ownerdir);
+	free(target);
+out:
+	free(home);
+	free(root);
+	free(source);
+
+	return ret;
+}
+
+static void
+git_host_tier_reap(const char *root) {
+	/* Removes the copies set aside by migrations more than GIT_TIER_GRACE seconds ago */
+	DIR * const owners = opendir(root);
+	const time_t now = time(NULL);
+	struct dirent *owner;
+
+	while (owners != NULL && (owner = readdir(owners)) != NULL) {
+		const int ownerfd = *owner->d_name != '.'
+			? openat(dirfd(owners), owner->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+		DIR * const repos = ownerfd >= 0 ? fdopendir(ownerfd) : NULL;
+		struct dirent *repo;
+
+		while (repos != NULL && (repo = readdir(repos)) != NULL) {
+			const char * const name = repo->d_name;
+			const size_t length = strlen(name);
+
+			if (*name != '.' || length < sizeof (".old") || strcmp(name + length - 4, ".old") != 0) {
+				continue;
+			}
+
+			const char *stamp = name + length - 4;
+			while (stamp > name && stamp[-1] != '.') {
+				stamp--;
+			}
+
+			const time_t aside = strtoll(stamp, NULL, 10);
+			if (aside != 0 && now - aside >= CONFIG_GIT_TIER_GRACE) {
+				git_host_tree_remove(ownerfd, name);
+				printf("%s/%s/%s reaped\n", root, owner->d_name, name);
+			}
+		}
+
+		if (repos != NULL) {
+			closedir(repos);
+		}
+	}
+
+	if (owners != NULL) {
+		closedir(owners);
+	}
+}
+
+static void
+git_host_tier_reap_all(void) {
+	struct git_host_tier *tiers;
+	const int count = git_host_tiers(&tiers);
+
+	for (int i = 0; i < count; i++) {
+		git_host_tier_reap(tiers[i].root);
+	}
+	git_host_tier_reap(CONFIG_GIT_HOME_REPOSITORIES);
+}
+
+static void noreturn
+git_host_maintenance_reap(int argc, char **argv) {
+	/* Reclaims the space of deleted repositories, and of the copies set aside by migrations and hibernation */
+	DIR * const trash = opendir(GIT_HOST_TRASH);
+	struct dirent *entry;
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (trash == NULL && errno != ENOENT) {
+		err(EXIT_FAILURE, "opendir "GIT_HOST_TRASH);
+	}
+
+	while (trash != NULL && (entry = readdir(trash)) != NULL) {
+		struct stat st;
+
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+			|| fstatat(dirfd(trash), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		/* Repositories stored on another tier were deleted as their symbolic link */
+		if (S_ISLNK(st.st_mode)) {
+			char * const trashed = git_host_pathcat(GIT_HOST_TRASH, entry->d_name);
+			char * const location = realpath(trashed, NULL);
+
+			if (location != NULL) {
+				git_host_tree_remove(AT_FDCWD, location);
+			}
+
+			free(location);
+			free(trashed);
+		}
+
+		git_host_tree_remove(dirfd(trash), entry->d_name);
+		printf(GIT_HOST_TRASH"/%s reaped\n", entry->d_name);
+	}
+
+	if (trash != NULL) {
+		closedir(trash);
+	}
+
+	git_host_tier_reap_all();
+
+	exit(EXIT_SUCCESS);
+}
+
+struct git_host_tiering {
+	struct git_host_tier *tiers;
+	int count;
+	int failures;
+};
+
+static void
+git_host_maintenance_tier_repository(const char *path, const char *repository, void *data) {
+	struct git_host_tiering * const tiering = data;
+	const int current = git_host_tier_find(tiering->tiers, tiering->count, repository);
+	const int64_t now = time(NULL);
+	struct git_host_access access;
+	int destination = -1;
+
+	if (git_host_access_read(repository, &access) != 0) {
+		/* Repositories never accessed since stamps exist only start aging now */
+		git_host_access_stamp(repository);
+		return;
+	}
+
+	git_host_access_decay(&access, now);
+
+	if (access.score >= CONFIG_GIT_TIER_PROMOTE) {
+		destination = 0;
+	} else if (now - access.last >= CONFIG_GIT_TIER_DEMOTE * 86400ll) {
+		destination = tiering->count - 1;
+	}
+
+	if (destination >= 0 && destination != current) {
+		const struct git_host_tier * const tier = &tiering->tiers[destination];
+
+		if (git_host_tier_migrate(path, repository, tier) == 0) {
+			printf("%s %s\n", path, tier->name);
+		} else {
+			tiering->failures++;
+		}
+	}
+}
+
+static void noreturn
+git_host_maintenance_tier(int argc, char **argv) {
+	/* Promotes recently accessed repositories to the first tier, demotes idle ones to the last */
+	struct git_host_tiering tiering = { 0 };
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (CONFIG_GIT_PUSH_QUEUE_TIMEOUT == 0) {
+		errx(EXIT_FAILURE, "Migrations need the push queue to hold pushes");
+	}
+
+	tiering.count = git_host_tiers(&tiering.tiers);
+	if (tiering.count < 2) {
+		errx(EXIT_FAILURE, "At least two tiers must be configured in "CONFIG_GIT_HOME_TIERS);
+	}
+
+	git_host_foreach_repository(git_host_maintenance_tier_repository, &tiering, 0);
+
+	git_host_tier_reap_all();
+
+	if (tiering.failures != 0) {
+		errx(EXIT_FAILURE, "Unable to migrate %d repositories", tiering.failures);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static void noreturn
+git_host_maintenance_migrate(int argc, char **argv) {
+	struct git_host_tier *tiers;
+	int count, i = 0;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <owner>/<repo> <tier>\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (CONFIG_GIT_PUSH_QUEUE_TIMEOUT == 0) {
+		errx(EXIT_FAILURE, "Migrations need the push queue to hold pushes");
+	}
+
+	char * const path = xstrdup(argv[1]);
+	if (git_host_normalize_path(path) != 0 || git_host_check_repository_shape(path) != 0) {
+		errx(EXIT_FAILURE, "Invalid repository path '%s'", argv[1]);
+	}
+
+	count = git_host_tiers(&tiers);
+	while (i < count && strcmp(tiers[i].name, argv[2]) != 0) {
+		i++;
+	}
+
+	if (i == count) {
+		errx(EXIT_FAILURE, "Unknown tier '%s'", argv[2]);
+	}
+
+	char * const repository = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path);
+	if (access(repository, F_OK) != 0) {
+		err(EXIT_FAILURE, "Unable to migrate '%s'", path);
+	}
+
+	if (git_host_tier_migrate(path, repository, &tiers[i]) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static int
+git_host_hibernate_filter(const char *name, mode_t mode) {
+	/* Objects are bundled instead, except alternates, reflogs could point to objects the bundle lacks */
+	if (strcmp(name, GIT_HOST_QUEUE) == 0 || strcmp(name, "logs") == 0) {
+		return 0;
+	}
+
+	if (strncmp(name, "objects/", 8) == 0) {
+		return strcmp(name, "objects/info/alternates") == 0
+			|| (S_ISDIR(mode) && (strcmp(name, "objects/info") == 0 || strcmp(name, "objects/pack") == 0));
+	}
+
+	return 1;
+}
+
+static void
+git_host_hibernate_entry(int fd, mode_t mode, const char *name, uint64_t size) {
+	const struct git_host_hibernation_entry entry = {
+		.mode = mode,
+		.namelength = strlen(name),
+		.size = size,
+	};
+
+	git_host_write_full(fd, &entry, sizeof (entry));
+	git_host_write_full(fd, name, entry.namelength);
+}
+
+static void
+git_host_hibernate_tree(int fd, int dirfd, const char *prefix) {
+	/* Appends the entries of a directory, parents before their children */
+	const int listfd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR * const dirp = listfd >= 0 ? fdopendir(listfd) : NULL;
+	const struct dirent *entry;
+
+	if (dirp == NULL) {
+		err(EXIT_FAILURE, "opendir");
+	}
+
+	while (entry = readdir(dirp), entry != NULL) {
+		struct stat st;
+
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+			|| fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		char * const name = *prefix != '\0' ? git_host_pathcat(prefix, entry->d_name) : xstrdup(entry->d_name);
+
+		if (!git_host_hibernate_filter(name, st.st_mode)) {
+			free(name);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			const int subdirfd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (subdirfd < 0) {
+				err(EXIT_FAILURE, "open %s", name);
+			}
+
+			git_host_hibernate_entry(fd, st.st_mode, name, 0);
+			git_host_hibernate_tree(fd, subdirfd, name);
+			close(subdirfd);
+		} else if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			const ssize_t length = readlinkat(dirfd, entry->d_name, target, sizeof (target));
+
+			if (length < 0) {
+				err(EXIT_FAILURE, "readlink %s", name);
+			}
+
+			git_host_hibernate_entry(fd, st.st_mode, name, length);
+			git_host_write_full(fd, target, length);
+		} else if (S_ISREG(st.st_mode)) {
+			const int in = openat(dirfd, entry->d_name, O_RDONLY | O_CLOEXEC);
+
+			if (in < 0) {
+				err(EXIT_FAILURE, "open %s", name);
+			}
+
+			git_host_hibernate_entry(fd, st.st_mode, name, st.st_size);
+			git_host_hibernation_copy(in, fd, st.st_size);
+			close(in);
+		}
+
+		free(name);
+	}
+
+	closedir(dirp);
+}
+
+static int
+git_host_hibernate(const char *path, const char *repository) {
+	/*
+	 * Replaces the repository, under its push queue, with a single file holding its files, refs packed beforehand,
+	 * and a bundle of its objects. It is thawed back by the first session which needs it, see git_host_thaw().
+	 */
+	char * const source = realpath(repository, NULL);
+	char *gitdirarg, **refs;
+
+	if (source == NULL) {
+		warn("Unable to hibernate '%s'", path);
+		return -1;
+	}
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", source) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	const int queue = git_host_queue(repository, path);
+	char * const packrefsargv[] = { "git", gitdirarg, "pack-refs", "--all", "--prune", NULL };
+	const int refscount = git_host_refs(source, &refs);
+
+	if (refscount < 0 || git_host_wait(git_host_spawn(git_host_execpath("git"), packrefsargv, -1, -1, -1)) != 0) {
+		warnx("Unable to hibernate '%s'", path);
+		close(queue);
+		free(gitdirarg);
+		free(source);
+		return -1;
+	}
+
+	for (int i = 0; i < refscount; i++) {
+		free(refs[i]);
+	}
+	free(refs);
+
+	char * const archive = git_host_sibling(repository, "hibernating");
+	const int fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	const int dirfd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0 || dirfd < 0) {
+		err(EXIT_FAILURE, "Unable to hibernate '%s'", path);
+	}
+
+	git_host_write_full(fd, GIT_HOST_HIBERNATION_MAGIC, sizeof (GIT_HOST_HIBERNATION_MAGIC) - 1);
+	git_host_hibernate_tree(fd, dirfd, "");
+	close(dirfd);
+
+	/* Empty repositories have nothing to bundle, the size of the bundle is only known once written */
+	if (refscount != 0) {
+		const off_t offset = lseek(fd, 0, SEEK_CUR);
+		char * const bundleargv[] = { "git", gitdirarg, "bundle", "create", "--quiet", "-", "--all", NULL };
+
+		git_host_hibernate_entry(fd, S_IFREG | 0444, GIT_HOST_HIBERNATION_BUNDLE, 0);
+
+		const off_t start = lseek(fd, 0, SEEK_CUR);
+		if (git_host_wait(git_host_spawn(git_host_execpath("git"), bundleargv, -1, fd, -1)) != 0) {
+			errx(EXIT_FAILURE, "Unable to bundle '%s'", path);
+		}
+
+		const uint64_t size = lseek(fd, 0, SEEK_CUR) - start;
+		if (pwrite(fd, &size, sizeof (size), offset + offsetof (struct git_host_hibernation_entry, size)) != sizeof (size)) {
+			err(EXIT_FAILURE, "Unable to hibernate '%s'", path);
+		}
+	}
+
+	if (fsync(fd) != 0 || close(fd) != 0) {
+		err(EXIT_FAILURE, "Unable to hibernate '%s'", path);
+	}
+
+	git_host_tier_exchange(repository, archive, source);
+
+	close(queue);
+	free(archive);
+	free(gitdirarg);
+	free(source);
+
+	return 0;
+}
+
+static void
+git_host_maintenance_hibernate_repository(const char *path, const char *repository, void *data) {
+	int * const failures = data;
+	struct git_host_access access;
+
+	if (git_host_access_read(repository, &access) != 0) {
+		/* Repositories never accessed since stamps exist only start aging now */
+		git_host_access_stamp(repository);
+		return;
+	}
+
+	if (time(NULL) - access.last >= CONFIG_GIT_HIBERNATE_DAYS * 86400ll) {
+		if (git_host_hibernate(path, repository) == 0) {
+			printf("%s hibernated\n", path);
+		} else {
+			++*failures;
+		}
+	}
+}
+
+static void noreturn
+git_host_maintenance_hibernate(int argc, char **argv) {
+	/* Hibernates the repositories idle for GIT_HIBERNATE_DAYS days, or the ones given */
+	int failures = 0;
+
+	if (CONFIG_GIT_PUSH_QUEUE_TIMEOUT == 0) {
+		errx(EXIT_FAILURE, "Hibernation needs the push queue to hold pushes");
+	}
+
+	if (argc == 1) {
+		if (CONFIG_GIT_HIBERNATE_DAYS == 0) {
+			errx(EXIT_FAILURE, "Hibernation is disabled");
+		}
+
+		git_host_foreach_repository(git_host_maintenance_hibernate_repository, &failures, 0);
+	}
+
+	for (int i = 1; i < argc; i++) {
+		char * const path = xstrdup(argv[i]);
+		char *repository = NULL;
+		struct stat st;
+
+		if (git_host_normalize_path(path) != 0 || git_host_check_repository_shape(path) != 0) {
+			warnx("Invalid repository path '%s'", argv[i]);
+			failures++;
+		} else if (repository = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path),
+			stat(repository, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			warnx("No repository '%s' to hibernate", path);
+			failures++;
+		} else if (git_host_hibernate(path, repository) != 0) {
+			failures++;
+		} else {
+			printf("%s hibernated\n", path);
+		}
+
+		free(repository);
+		free(path);
+	}
+
+	/* Copies set aside are reaped as those of migrations */
+	git_host_tier_reap_all();
+
+	if (failures != 0) {
+		errx(EXIT_FAILURE, "Unable to hibernate %d repositories", failures);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+struct git_host_refs_migration {
+	int threshold;
+	int failures;
+};
+
+static int
+git_host_migrate_refs(const char *path, const char *repository) {
+	/* Converts the refs of a repository to reftable, holding its push queue so no push races the conversion */
+	char *gitdirarg;
+
+	if (asprintf(&gitdirarg, "--git-dir=%s", repository) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	char * const migrateargv[] = { "git", gitdirarg, "refs", "migrate", "--ref-format=reftable", NULL };
+	const int queue = git_host_queue(repository, path);
+	const int status = git_host_wait(git_host_spawn(git_host_execpath("git"), migrateargv, -1, -1, -1));
+
+	close(queue);
+	free(gitdirarg);
+
+	if (status != 0) {
+		warnx("Unable to migrate refs of '%s'", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+git_host_maintenance_migrate_refs_repository(const char *path, const char *repository, void *data) {
+	struct git_host_refs_migration * const migration = data;
+	char * const reftable = git_host_pathcat(repository, "reftable");
+	const int migrated = access(reftable, F_OK) == 0;
+	char **refs;
+
+	free(reftable);
+	if (migrated) {
+		return;
+	}
+
+	/* Only repositories with many refs suffer from packed-refs rewrites */
+	const int count = git_host_refs(repository, &refs);
+	for (int i = 0; i < count; i++) {
+		free(refs[i]);
+	}
+	if (count >= 0) {
+		free(refs);
+	}
+
+	if (count >= migration->threshold) {
+		if (git_host_migrate_refs(path, repository) == 0) {
+			printf("%s reftable %d\n", path, count);
+		} else {
+			migration->failures++;
+		}
+	}
+}
+
+static void noreturn
+git_host_maintenance_migrate_refs(int argc, char **argv) {
+	/* Migrates the repositories with at least GIT_REFTABLE_REFS refs, or the ones given */
+	struct git_host_refs_migration migration = { .threshold = CONFIG_GIT_REFTABLE_REFS, .failures = 0 };
+	int i = 1;
+	char *end;
+
+	if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+		migration.threshold = strtol(argv[2], &end, 10);
+		if (*end != '\0' || migration.threshold <= 0) {
+			errx(EXIT_FAILURE, "Invalid number of refs '%s'", argv[2]);
+		}
+		i = 3;
+	}
+
+	if (i < argc && *argv[i] == '-') {
+		fprintf(stderr, "usage: %s [-n <refs>] [<owner>/<repo>...]\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (CONFIG_GIT_PUSH_QUEUE_TIMEOUT == 0) {
+		errx(EXIT_FAILURE, "Migrations need the push queue to hold pushes");
+	}
+
+	if (i == argc) {
+		git_host_foreach_repository(git_host_maintenance_migrate_refs_repository, &migration, 0);
+	}
+
+	for (; i < argc; i++) {
+		char * const path = xstrdup(argv[i]);
+		char *repository = NULL;
+		struct stat st;
+
+		if (git_host_normalize_path(path) != 0 || git_host_check_repository_shape(path) != 0) {
+			warnx("Invalid repository path '%s'", argv[i]);
+			migration.failures++;
+		} else if (repository = git_host_pathcat(CONFIG_GIT_HOME_REPOSITORIES, path),
+			stat(repository, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			warnx("No repository '%s' to migrate", path);
+			migration.failures++;
+		} else if (git_host_migrate_refs(path, repository) != 0) {
+			migration.failures++;
+		} else {
+			printf("%s reftable\n", path);
+		}
+
+		free(repository);
+		free(path);
+	}
+
+	if (migration.failures != 0) {
+		errx(EXIT_FAILURE, "Unable to migrate refs of %d repositories", migration.failures);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+struct git_host_profiling {
+	int apply;
+	int jobs;
+	int running;
+	int failures;
+};
+
+static int
+git_host_profile_equal(const struct git_host_profile_setting *setting, const char *value) {
+	/* Whether value means the setting's own, say yes or on for true, or 64m for 67108864, as git reads them */
+	char *typearg, canonical[64], expected[64];
+
+	if (strcmp(value, setting->value) == 0) {
+		return 1;
+	}
+
+	if (setting->type == NULL) {
+		return 0;
+	}
+
+	if (asprintf(&typearg, "--type=%s", setting->type) < 0) {
+		err(EXIT_FAILURE, "asprintf");
+	}
+
+	char * const valueargv[] = { "git", "config", "--file", "/dev/null", typearg,
+		"--default", (char *)value, "--get", (char *)setting->key, NULL };
+	char * const expectedargv[] = { "git", "config", "--file", "/dev/null", typearg,
+		"--default", (char *)setting->value, "--get", (char *)setting->key, NULL };
+
+	/* Values git can't read as the type are drifted */
+	const int equal = git_host_capture(valueargv, canonical, sizeof (canonical)) == 0
+		&& git_host_capture(expectedargv, expected, sizeof (expected)) == 0 && strcmp(canonical, expected) == 0;
+
+	free(typearg);
+
+	return equal;
+}
+
+static int
+git_host_profile_repository(const char *path, const char *repository, int apply) {
+	/* Reports the settings of the repository which drifted from its profile, and resets them if applying */
+	char * const profile = git_host_profile_name(path);
+	char * const config = git_host_pathcat(repository, "config");
+	char * const listargv[] = { "git", "config", "--file", config, "--list", NULL };
+	char **lines = NULL, *line = NULL;
+	int fds[2], count = 0, drifted = 0, failed = 0;
+	size_t n = 0;
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), listargv, -1, fds[1], -1);
+	FILE * const filep = fdopen(fds[0], "r");
+
+	close(fds[1]);
+	if (filep == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	while (getline(&line, &n, filep) >= 0) {
+		line[strcspn(line, "\n")] = '\0';
+		git_host_array_push(xstrdup(line), &count, &lines);
+	}
+	free(line);
+	fclose(filep);
+
+	if (git_host_wait(pid) != 0) {
+		warnx("Unable to read the configuration of '%s'", path);
+		failed = 1;
+	}
+
+	for (const struct git_host_profile_setting *setting = git_host_profile(profile);
+		!failed && setting->key != NULL; setting++) {
+		const size_t keylength = strlen(setting->key);
+		const char *value = NULL;
+
+		/* Keys are listed lowercased, the last value wins */
+		for (int i = 0; i < count; i++) {
+			if (strncasecmp(lines[i], setting->key, keylength) == 0 && lines[i][keylength] == '=') {
+				value = lines[i] + keylength + 1;
+			}
+		}
+
+		if (value == NULL || !git_host_profile_equal(setting, value)) {
+			printf("%s %s %s %s %s\n", path, profile, setting->key, value != NULL ? value : "-", setting->value);
+			drifted = 1;
+
+			if (apply && git_host_profile_set(repository, setting->key, setting->value) != 0) {
+				warnx("Unable to set %s in '%s'", setting->key, path);
+				failed = 1;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		free(lines[i]);
+	}
+	free(lines);
+	free(config);
+	free(profile);
+
+	return failed || (!apply && drifted) ? -1 : 0;
+}
+
+static void
+git_host_maintenance_profile_repository(const char *path, const char *repository, void *data) {
+	struct git_host_profiling * const profiling = data;
+
+	if (profiling->running == profiling->jobs) {
+		git_host_reap(&profiling->running, &profiling->failures);
+	}
+
+	fflush(stdout);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		const int ret = git_host_profile_repository(path, repository, profiling->apply);
+
+		fflush(stdout);
+		exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	profiling->running++;
+}
+
+static void noreturn
+git_host_maintenance_profile(int argc, char **argv) {
+	/* Audits, or applies, the performance profile of every repository, printing drifted settings */
+	struct git_host_profiling profiling = {
+		.apply = 0,
+		.jobs = git_host_threads(UINT_MAX),
+		.running = 0,
+		.failures = 0,
+	};
+	char *end;
+	int i = 1;
+
+	if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+		profiling.jobs = strtol(argv[2], &end, 10);
+		if (*end != '\0' || profiling.jobs <= 0) {
+			errx(EXIT_FAILURE, "Invalid number of jobs '%s'", argv[2]);
+		}
+		i = 3;
+	}
+
+	if (i + 1 != argc || (strcmp(argv[i], "audit") != 0 && strcmp(argv[i], "apply") != 0)) {
+		fprintf(stderr, "usage: %s [-j <jobs>] audit|apply\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+	profiling.apply = strcmp(argv[i], "apply") == 0;
+
+	git_host_foreach_repository(git_host_maintenance_profile_repository, &profiling, 0);
+
+	while (profiling.running != 0) {
+		git_host_reap(&profiling.running, &profiling.failures);
+	}
+
+	if (profiling.failures != 0) {
+		errx(EXIT_FAILURE, profiling.apply ? "Unable to apply the profiles of %d repositories"
+			: "%d repositories don't match their profile", profiling.failures);
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+/* Sessions handed over to a broker, see git_host_maintenance_broker() */
+#define GIT_HOST_BROKER_REQUEST_MAX 8192
+#define GIT_HOST_BROKER_FALLBACK    (-1)
+
+static const char * const git_host_broker_environment[] = {
+	"SSH_AUTHORIZED_BY", "SSH_AUTHORIZED_TOKEN", "GIT_PROTOCOL", NULL,
+};
+
+static int
+git_host_broker_address(struct sockaddr_un *address) {
+	memset(address, 0, sizeof (*address));
+	address->sun_family = AF_UNIX;
+
+	if (sizeof (CONFIG_GIT_HOME_BROKER) > sizeof (address->sun_path)) {
+		return -1;
+	}
+	memcpy(address->sun_path, CONFIG_GIT_HOME_BROKER, sizeof (CONFIG_GIT_HOME_BROKER));
+
+	return 0;
+}
+
+static void
+git_host_broker_submit(const char *command) {
+	/*
+	 * Hands the session over to the broker, along with the standard streams and the environment it depends on,
+	 * then only waits for its exit status. Returns if no broker takes it, for the session to run directly.
+	 */
+	char request[GIT_HOST_BROKER_REQUEST_MAX];
+	struct sockaddr_un address;
+	size_t length;
+
+	length = snprintf(request, sizeof (request), "%s", command) + 1;
+	for (const char * const *name = git_host_broker_environment; *name != NULL && length <= sizeof (request); name++) {
+		const char * const value = getenv(*name);
+
+		if (value != NULL) {
+			length += snprintf(request + length, sizeof (request) - length, "%s=%s", *name, value) + 1;
+		}
+	}
+
+	if (length > sizeof (request) || git_host_broker_address(&address) != 0) {
+		return;
+	}
+
+	const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0 || connect(sock, (const struct sockaddr *)&address, sizeof (address)) != 0) {
+		if (sock >= 0) {
+			close(sock);
+		}
+		return;
+	}
+
+	const int fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof (fds))];
+	} control;
+	struct iovec iov = { .iov_base = request, .iov_len = length };
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof (control.buffer),
+	};
+	struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&message);
+
+	memset(&control, 0, sizeof (control));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof (fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof (fds));
+
+	if (sendmsg(sock, &message, MSG_NOSIGNAL) != (ssize_t)length) {
+		close(sock);
+		return;
+	}
+
+	int32_t status;
+	ssize_t received;
+	while (received = recv(sock, &status, sizeof (status), 0), received < 0 && errno == EINTR);
+
+	if (received != sizeof (status)) {
+		errx(EXIT_FAILURE, "Lost the broker running the session");
+	}
+
+	/* A broker shutting down gives back the sessions it didn't start yet */
+	if (status == GIT_HOST_BROKER_FALLBACK) {
+		close(sock);
+		return;
+	}
+
+	exit(status);
+}
+
+struct git_host_broker_session {
+	int sock;
+	int fds[3];
+	char *request;
+	size_t length;
+	const char *user;
+	pid_t pid;
+	struct timespec start;
+};
+
+struct git_host_broker {
+	struct git_host_broker_session *sessions;
+	int count;
+	int running;
+	int listenfd;
+	int signalfd;
+};
+
+static void
+git_host_broker_close(struct git_host_broker *broker, int i, int32_t status) {
+	/* Answers the client of the session, then forgets about it */
+	struct git_host_broker_session * const session = &broker->sessions[i];
+
+	send(session->sock, &status, sizeof (status), MSG_NOSIGNAL);
+	close(session->sock);
+
+	if (session->pid == 0) {
+		for (int fd = 0; fd < 3; fd++) {
+			close(session->fds[fd]);
+		}
+	} else {
+		broker->running--;
+	}
+
+	free(session->request);
+	memmove(session, session + 1, (broker->count - i - 1) * sizeof (*session));
+	broker->count--;
+}
+
+static void
+git_host_broker_accept(struct git_host_broker *broker) {
+	char request[GIT_HOST_BROKER_REQUEST_MAX];
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(3 * sizeof (int))];
+	} control;
+	struct iovec iov = { .iov_base = request, .iov_len = sizeof (request) };
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof (control.buffer),
+	};
+	struct ucred credentials;
+	socklen_t credentialslength = sizeof (credentials);
+	int fds[3] = { -1, -1, -1 };
+	ssize_t length;
+
+	const int sock = accept4(broker->listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		warn("accept");
+		return;
+	}
+
+	/* Only sessions of the git user itself are trusted with running as it */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialslength) != 0
+		|| credentials.uid != getuid()) {
+		close(sock);
+		return;
+	}
+
+	while (length = recvmsg(sock, &message, MSG_CMSG_CLOEXEC), length < 0 && errno == EINTR);
+
+	const struct cmsghdr * const cmsg = length > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fds, CMSG_DATA(cmsg), (cmsg->cmsg_len - CMSG_LEN(0)) < sizeof (fds) ? cmsg->cmsg_len - CMSG_LEN(0) : sizeof (fds));
+	}
+
+	if (length <= 0 || request[length - 1] != '\0' || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		|| fds[0] < 0 || fds[1] < 0 || fds[2] < 0) {
+		for (int fd = 0; fd < 3; fd++) {
+			if (fds[fd] >= 0) {
+				close(fds[fd]);
+			}
+		}
+		close(sock);
+		return;
+	}
+
+	broker->sessions = realloc(broker->sessions, (broker->count + 1) * sizeof (*broker->sessions));
+	if (broker->sessions == NULL) {
+		err(EXIT_FAILURE, "realloc");
+	}
+
+	struct git_host_broker_session * const session = &broker->sessions[broker->count++];
+	session->sock = sock;
+	memcpy(session->fds, fds, sizeof (fds));
+	session->request = malloc(length);
+	if (session->request == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	memcpy(session->request, request, length);
+	session->length = length;
+	session->user = "-";
+	session->pid = 0;
+
+	for (const char *it = session->request; it < session->request + length; it += strlen(it) + 1) {
+		if (strncmp(it, "SSH_AUTHORIZED_BY=", 18) == 0) {
+			session->user = it + 18;
+		}
+	}
+
+	/* Beyond the backlog, clients are turned away rather than left waiting */
+	if (broker->count - broker->running > CONFIG_GIT_BROKER_BACKLOG) {
+		dprintf(session->fds[2], "git-host: Too many sessions waiting, try again later\n");
+		git_host_broker_close(broker, broker->count - 1, EXIT_FAILURE);
+	}
+}
+
+static void
+git_host_broker_start(struct git_host_broker *broker, struct git_host_broker_session *session) {
+	fflush(stdout);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		warn("fork");
+		return;
+	}
+
+	if (pid == 0) {
+		const char *command = session->request;
+		sigset_t mask;
+		char **arguments;
+		int count;
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		for (int fd = 0; fd < 3; fd++) {
+			if (dup2(session->fds[fd], fd) < 0) {
+				err(EXIT_FAILURE, "dup2");
+			}
+		}
+
+		/*
+		 * Sessions may outlive the broker, they must not keep it reachable nor hold other clients,
+		 * whose descriptors are still held by the sessions waiting, the session's own included once duplicated.
+		 */
+		close(broker->listenfd);
+		close(broker->signalfd);
+		for (int i = 0; i < broker->count; i++) {
+			close(broker->sessions[i].sock);
+
+			for (int fd = 0; broker->sessions[i].pid == 0 && fd < 3; fd++) {
+				close(broker->sessions[i].fds[fd]);
+			}
+		}
+
+		/* The session gets its client's environment, not whatever a previous one left */
+		for (const char * const *name = git_host_broker_environment; *name != NULL; name++) {
+			unsetenv(*name);
+		}
+
+		for (char *it = session->request + strlen(command) + 1; it < session->request + session->length; it += strlen(it) + 1) {
+			putenv(it);
+		}
+
+		/* Admitted along with the sessions running, its compressors get their share of the processors, see git_host_threads() */
+		const long online = sysconf(_SC_NPROCESSORS_ONLN);
+		if (online > 0) {
+			char share[24];
+
+			snprintf(share, sizeof (share), "%ld", online > broker->running ? online / (broker->running + 1) : 1);
+			setenv("GIT_HOST_THREADS", share, 1);
+		}
+
+		git_host_expand_command(command, &count, &arguments);
+		git_host_exec(count, arguments);
+	}
+
+	for (int fd = 0; fd < 3; fd++) {
+		close(session->fds[fd]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &session->start);
+	session->pid = pid;
+	broker->running++;
+}
+
+static void
+git_host_broker_schedule(struct git_host_broker *broker) {
+	/* Starts waiting sessions in arrival order, skipping those of users already running their share */
+	for (int i = 0; i < broker->count && broker->running < CONFIG_GIT_BROKER_SESSIONS; i++) {
+		struct git_host_broker_session * const session = &broker->sessions[i];
+		int running = 0;
+
+		if (session->pid != 0) {
+			continue;
+		}
+
+		for (int j = 0; j < broker->count; j++) {
+			running += broker->sessions[j].pid != 0 && strcmp(broker->sessions[j].user, session->user) == 0;
+		}
+
+		if (running < CONFIG_GIT_BROKER_USER_SESSIONS) {
+			git_host_broker_start(broker, session);
+		}
+	}
+}
+
+static void
+git_host_broker_reap(struct git_host_broker *broker) {
+	/* Accounts each finished session as `<user> <command> <status> <wall ms> <user ms> <system ms> <max rss KiB>` */
+	struct rusage usage;
+	int wstatus;
+	pid_t pid;
+
+	while (pid = wait4(-1, &wstatus, WNOHANG, &usage), pid > 0) {
+		int i = 0;
+
+		while (i < broker->count && broker->sessions[i].pid != pid) {
+			i++;
+		}
+
+		if (i == broker->count) {
+			continue;
+		}
+
+		const struct git_host_broker_session * const session = &broker->sessions[i];
+		const int32_t status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+		struct timespec end;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("%s %s %d %lld %lld %lld %ld\n", session->user, session->request, (int)status,
+			(long long)(end.tv_sec - session->start.tv_sec) * 1000 + (end.tv_nsec - session->start.tv_nsec) / 1000000,
+			(long long)usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000,
+			(long long)usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000,
+			usage.ru_maxrss);
+		fflush(stdout);
+
+		git_host_broker_close(broker, i, status);
+	}
+}
 
 static void noreturn
-git_host_exec_git_receive_pack(int argc, char **argv) {
-	git_host_exec_rx_tx(argc, argv, GIT_HOST_MODE_WR);
+git_host_maintenance_broker(int argc, char **argv) {
+	/*
+	 * Runs the sessions handed over by git-host -c, at most GIT_BROKER_SESSIONS at once and GIT_BROKER_USER_SESSIONS per user,
+	 * the others wait in arrival order. Terminating the broker gives back waiting sessions to their clients, which run them
+	 * directly, then lets running ones finish.
+	 */
+	struct git_host_broker broker = { .sessions = NULL, .count = 0, .running = 0, .listenfd = -1, .signalfd = -1 };
+	struct sockaddr_un address;
+	sigset_t mask;
+	int stopping = 0;
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s\n", *argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (git_host_broker_address(&address) != 0) {
+		errx(EXIT_FAILURE, "Broker socket path "CONFIG_GIT_HOME_BROKER" is too long");
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+		err(EXIT_FAILURE, "sigprocmask");
+	}
+
+	broker.signalfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	broker.listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (broker.signalfd < 0 || broker.listenfd < 0) {
+		err(EXIT_FAILURE, "Unable to start the broker");
+	}
+
+	/* A socket nobody listens on anymore is stale */
+	if (connect(broker.listenfd, (const struct sockaddr *)&address, sizeof (address)) == 0) {
+		errx(EXIT_FAILURE, "A broker is already listening on "CONFIG_GIT_HOME_BROKER);
+	}
+	close(broker.listenfd);
+	unlink(CONFIG_GIT_HOME_BROKER);
+
+	const mode_t previous = umask(077);
+	broker.listenfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (broker.listenfd < 0 || bind(broker.listenfd, (const struct sockaddr *)&address, sizeof (address)) != 0
+		|| listen(broker.listenfd, SOMAXCONN) != 0) {
+		err(EXIT_FAILURE, "Unable to listen on "CONFIG_GIT_HOME_BROKER);
+	}
+	umask(previous);
+
+	while (!stopping || broker.running != 0) {
+		struct pollfd fds[2 + broker.count];
+		nfds_t nfds = 0;
+
+		fds[nfds++] = (struct pollfd) { .fd = broker.signalfd, .events = POLLIN };
+		if (!stopping) {
+			fds[nfds++] = (struct pollfd) { .fd = broker.listenfd, .events = POLLIN };
+		}
+
+		/* Clients waiting for their session to start may give up */
+		const nfds_t first = nfds;
+		for (int i = 0; i < broker.count; i++) {
+			fds[nfds++] = (struct pollfd) { .fd = broker.sessions[i].pid == 0 ? broker.sessions[i].sock : -1 };
+		}
+
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err(EXIT_FAILURE, "poll");
+		}
+
+		for (int i = broker.count - 1; i >= 0; i--) {
+			if (fds[first + i].revents & (POLLHUP | POLLERR)) {
+				git_host_broker_close(&broker, i, EXIT_FAILURE);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			struct signalfd_siginfo info;
+
+			if (read(broker.signalfd, &info, sizeof (info)) == sizeof (info) && info.ssi_signo != SIGCHLD && !stopping) {
+				stopping = 1;
+				close(broker.listenfd);
+				unlink(CONFIG_GIT_HOME_BROKER);
+
+				for (int i = broker.count - 1; i >= 0; i--) {
+					if (broker.sessions[i].pid == 0) {
+						git_host_broker_close(&broker, i, GIT_HOST_BROKER_FALLBACK);
+					}
+				}
+			}
+
+			git_host_broker_reap(&broker);
+		}
+
+		if (!stopping && (fds[1].revents & POLLIN)) {
+			git_host_broker_accept(&broker);
+		}
+
+		if (!stopping) {
+			git_host_broker_schedule(&broker);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+git_host_chdir_home(void) {
+	const char *home = getenv("HOME");
+
+	if (home == NULL) {
+		const struct passwd * const pw = getpwuid(getuid());
+
+		if (pw == NULL) {
+			errx(EXIT_FAILURE, "Unable to find the home directory");
+		}
+		home = pw->pw_dir;
+	}
+
+	if (chdir(home) != 0) {
+		err(EXIT_FAILURE, "chdir %s", home);
+	}
+}
+
+struct git_host_policy {
+	unsigned long long maxfilesize;
+	char **forbidden;
+	int forbiddencount;
+	regex_t message;
+	int hasmessage;
+	char **secrets;
+	int secretscount;
+};
+
+static int
+git_host_policy_load(struct git_host_policy *policy) {
+	/* Returns zero if there is no policy to enforce */
+	FILE * const filep = fopen(CONFIG_GIT_HOME_POLICY, "r");
+	char *line = NULL;
+	size_t n = 0, lineno = 0;
+	ssize_t length;
+
+	*policy = (struct git_host_policy) { .maxfilesize = 0 };
+
+	if (filep == NULL) {
+		if (errno != ENOENT) {
+			err(EXIT_FAILURE, "fopen "CONFIG_GIT_HOME_POLICY);
+		}
+		return 0;
+	}
+
+	while (length = getline(&line, &n, filep), length >= 0) {
+		lineno++;
+		if (length != 0 && line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+
+		/* Values extend to the end of the line, patterns and secrets may contain blanks */
+		char * const directive = line + strspn(line, " \t");
+		if (*directive == '\0' || *directive == '#') {
+			continue;
+		}
+
+		char *value = directive + strcspn(directive, " \t");
+		if (*value != '\0') {
+			*value++ = '\0';
+			value += strspn(value, " \t");
+		}
+
+		if (*value == '\0') {
+			errx(EXIT_FAILURE, CONFIG_GIT_HOME_POLICY":%zu: Missing value for '%s'", lineno, directive);
+		}
+
+		if (strcmp(directive, "max-file-size") == 0) {
+			if (git_host_parse_size(value, &policy->maxfilesize) != 0) {
+				errx(EXIT_FAILURE, CONFIG_GIT_HOME_POLICY":%zu: Invalid size '%s'", lineno, value);
+			}
+		} else if (strcmp(directive, "forbid-path") == 0) {
+			git_host_array_push(xstrdup(value), &policy->forbiddencount, &policy->forbidden);
+		} else if (strcmp(directive, "commit-message") == 0) {
+			if (policy->hasmessage) {
+				regfree(&policy->message);
+			}
+
+			const int errcode = regcomp(&policy->message, value, REG_EXTENDED | REG_NOSUB);
+			if (errcode != 0) {
+				char error[256];
+
+				regerror(errcode, &policy->message, error, sizeof (error));
+				errx(EXIT_FAILURE, CONFIG_GIT_HOME_POLICY":%zu: Invalid regular expression '%s': %s", lineno, value, error);
+			}
+			policy->hasmessage = 1;
+		} else if (strcmp(directive, "secret") == 0) {
+			git_host_array_push(xstrdup(value), &policy->secretscount, &policy->secrets);
+		} else {
+			errx(EXIT_FAILURE, CONFIG_GIT_HOME_POLICY":%zu: Invalid directive '%s', expected one of:\n"
+				"\tmax-file-size <size>\n"
+				"\tforbid-path <pattern>\n"
+				"\tcommit-message <regular expression>\n"
+				"\tsecret <string>", lineno, directive);
+		}
+	}
+
+	free(line);
+	fclose(filep);
+
+	return policy->maxfilesize != 0 || policy->forbiddencount != 0
+		|| policy->hasmessage || policy->secretscount != 0;
+}
+
+/* Maximum size of blobs read ahead of the scanning threads */
+#define GIT_HOST_POLICY_QUEUED (64ul << 20)
+
+struct git_host_policy_blob {
+	struct git_host_policy_blob *next;
+	char *path;
+	char *data;
+	size_t size;
+};
+
+struct git_host_policy_scanner {
+	const struct git_host_policy *policy;
+	pthread_mutex_t mutex;
+	pthread_cond_t available, consumed;
+	struct git_host_policy_blob *head, **tailp;
+	size_t queued;
+	int done;
+	unsigned int violations;
+};
+
+static void
+git_host_policy_violation(struct git_host_policy_scanner *scanner, const char *format, ...) {
+	va_list ap;
+
+	pthread_mutex_lock(&scanner->mutex);
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+
+	scanner->violations++;
+
+	pthread_mutex_unlock(&scanner->mutex);
+}
+
+static void *
+git_host_policy_scan(void *data) {
+	struct git_host_policy_scanner * const scanner = data;
+	const struct git_host_policy * const policy = scanner->policy;
+
+	pthread_mutex_lock(&scanner->mutex);
+
+	for (;;) {
+		struct git_host_policy_blob *blob;
+
+		while (blob = scanner->head, blob == NULL && !scanner->done) {
+			pthread_cond_wait(&scanner->available, &scanner->mutex);
+		}
+
+		if (blob == NULL) {
+			break;
+		}
+
+		if (scanner->head = blob->next, scanner->head == NULL) {
+			scanner->tailp = &scanner->head;
+		}
+		scanner->queued -= blob->size;
+		pthread_cond_signal(&scanner->consumed);
+
+		pthread_mutex_unlock(&scanner->mutex);
+
+		/* memmem(3) is vectorized by the C library, each pass over a blob is bounded by memory bandwidth */
+		int i = 0;
+		while (i < policy->secretscount
+			&& memmem(blob->data, blob->size, policy->secrets[i], strlen(policy->secrets[i])) == NULL) {
+			i++;
+		}
+
+		if (i < policy->secretscount) {
+			git_host_policy_violation(scanner, "%s: Contains a secret", blob->path);
+		}
+
+		free(blob->path);
+		free(blob->data);
+		free(blob);
+
+		pthread_mutex_lock(&scanner->mutex);
+	}
+
+	pthread_mutex_unlock(&scanner->mutex);
+
+	return NULL;
+}
+
+static void
+git_host_policy_queue(struct git_host_policy_scanner *scanner, struct git_host_policy_blob *blob) {
+	pthread_mutex_lock(&scanner->mutex);
+
+	/* A single blob larger than the bound is still queued, alone */
+	while (scanner->queued != 0 && scanner->queued + blob->size > GIT_HOST_POLICY_QUEUED) {
+		pthread_cond_wait(&scanner->consumed, &scanner->mutex);
+	}
+
+	blob->next = NULL;
+	*scanner->tailp = blob;
+	scanner->tailp = &blob->next;
+	scanner->queued += blob->size;
+	pthread_cond_signal(&scanner->available);
+
+	pthread_mutex_unlock(&scanner->mutex);
+}
+
+struct git_host_policy_batch {
+	FILE *commands;
+	FILE *responses;
+	char *line;
+	size_t n;
+};
+
+static int
+git_host_policy_request(struct git_host_policy_batch *batch, const char *command, const char *oid, char type[static 16], size_t *sizep) {
+	/* Sends a cat-file --batch-command request, and parses its <oid> <type> <size> response */
+	if (fprintf(batch->commands, "%s %s\n", command, oid) < 0 || fflush(batch->commands) != 0) {
+		err(EXIT_FAILURE, "git cat-file");
+	}
+
+	if (getline(&batch->line, &batch->n, batch->responses) < 0) {
+		errx(EXIT_FAILURE, "git cat-file: Unexpected end of output");
+	}
+
+	return sscanf(batch->line, "%*s %15s %zu", type, sizep) == 2 ? 0 : -1;
+}
+
+static char *
+git_host_policy_contents(struct git_host_policy_batch *batch, const char *oid, size_t *sizep) {
+	char type[16];
+	size_t size;
+
+	if (git_host_policy_request(batch, "contents", oid, type, &size) != 0) {
+		errx(EXIT_FAILURE, "git cat-file: Unable to read %s", oid);
+	}
+
+	char * const data = malloc(size + 1);
+	if (data == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	/* Contents are followed by a newline */
+	if (fread(data, 1, size, batch->responses) != size || fgetc(batch->responses) != '\n') {
+		errx(EXIT_FAILURE, "git cat-file: Truncated contents of %s", oid);
+	}
+	data[size] = '\0';
+
+	*sizep = size;
+	return data;
+}
+
+static void
+git_host_policy_paths(struct git_host_policy_scanner *scanner, char **tips, int tipscount) {
+	/* Every path added or modified by the pushed commits, whatever blob it holds, including renames, copies and merges */
+	char **log = NULL, *path = NULL;
+	int count = 0, fds[2];
+	size_t n = 0;
+
+	git_host_array_push("git", &count, &log);
+	git_host_array_push("log", &count, &log);
+	git_host_array_push("-z", &count, &log);
+	git_host_array_push("--format=", &count, &log);
+	git_host_array_push("--name-only", &count, &log);
+	git_host_array_push("--no-renames", &count, &log);
+	git_host_array_push("--diff-filter=d", &count, &log);
+	git_host_array_push("-m", &count, &log);
+	for (int i = 0; i < tipscount; i++) {
+		git_host_array_push(tips[i], &count, &log);
+	}
+	git_host_array_push("--not", &count, &log);
+	git_host_array_push("--all", &count, &log);
+	git_host_array_push(NULL, &count, &log);
+
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	const pid_t pid = git_host_spawn(git_host_execpath("git"), log, -1, fds[1], -1);
+	close(fds[1]);
+
+	FILE * const paths = fdopen(fds[0], "r");
+	if (paths == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	while (getdelim(&path, &n, '\0', paths) >= 0) {
+		const struct git_host_policy * const policy = scanner->policy;
+		int i = 0;
+
+		while (*path != '\0' && i < policy->forbiddencount && fnmatch(policy->forbidden[i], path, 0) != 0) {
+			i++;
+		}
+
+		if (*path != '\0' && i < policy->forbiddencount) {
+			git_host_policy_violation(scanner, "%s: Forbidden path", path);
+		}
+	}
+
+	free(path);
+	fclose(paths);
+	free(log);
+
+	if (git_host_wait(pid) != 0) {
+		errx(EXIT_FAILURE, "Unable to check pushed paths against the policy");
+	}
 }
 
 static void noreturn
-git_host_exec_git_upload_X(int argc, char **argv) {
-	git_host_exec_rx_tx(argc, argv, GIT_HOST_MODE_RO);
+git_host_hook_pre_receive(int argc, char **argv) {
+	/* Walks the pushed objects once, checking commits and blobs against the policy, secrets are scanned in parallel */
+	struct git_host_policy policy;
+	char **tips = NULL, **revlist = NULL, *line = NULL;
+	int tipscount = 0, count = 0;
+	size_t n = 0;
+
+	if (!git_host_policy_load(&policy)) {
+		exit(EXIT_SUCCESS);
+	}
+
+	while (getline(&line, &n, stdin) >= 0) {
+		char *saveptr;
+
+		const char * const old = strtok_r(line, " \n", &saveptr);
+		const char * const new = strtok_r(NULL, " \n", &saveptr);
+
+		/* Deletions have nothing to check */
+		if (old != NULL && new != NULL && new[strspn(new, "0")] != '\0') {
+			git_host_array_push(xstrdup(new), &tipscount, &tips);
+		}
+	}
+
+	if (tipscount == 0) {
+		exit(EXIT_SUCCESS);
+	}
+
+	git_host_array_push("git", &count, &revlist);
+	git_host_array_push("rev-list", &count, &revlist);
+	git_host_array_push("--objects", &count, &revlist);
+	for (int i = 0; i < tipscount; i++) {
+		git_host_array_push(tips[i], &count, &revlist);
+	}
+	git_host_array_push("--not", &count, &revlist);
+	git_host_array_push("--all", &count, &revlist);
+	git_host_array_push(NULL, &count, &revlist);
+
+	int revfds[2], infds[2], outfds[2];
+	if (pipe2(revfds, O_CLOEXEC) != 0 || pipe2(infds, O_CLOEXEC) != 0 || pipe2(outfds, O_CLOEXEC) != 0) {
+		err(EXIT_FAILURE, "pipe2");
+	}
+
+	char * const catfile[] = { "git", "cat-file", "--batch-command", NULL };
+	const pid_t revpid = git_host_spawn(git_host_execpath("git"), revlist, -1, revfds[1], -1);
+	const pid_t catpid = git_host_spawn(git_host_execpath("git"), catfile, infds[0], outfds[1], -1);
+	close(revfds[1]);
+	close(infds[0]);
+	close(outfds[1]);
+
+	FILE * const objects = fdopen(revfds[0], "r");
+	struct git_host_policy_batch batch = {
+		.commands = fdopen(infds[1], "w"),
+		.responses = fdopen(outfds[0], "r"),
+	};
+	if (objects == NULL || batch.commands == NULL || batch.responses == NULL) {
+		err(EXIT_FAILURE, "fdopen");
+	}
+
+	struct git_host_policy_scanner scanner = {
+		.policy = &policy,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.available = PTHREAD_COND_INITIALIZER,
+		.consumed = PTHREAD_COND_INITIALIZER,
+		.head = NULL,
+		.tailp = &scanner.head,
+	};
+	const unsigned int threads = policy.secretscount != 0 ? git_host_threads(CONFIG_GIT_POLICY_THREADS) : 0;
+	pthread_t workers[threads + 1];
+
+	for (unsigned int i = 0; i < threads; i++) {
+		if (errno = pthread_create(&workers[i], NULL, git_host_policy_scan, &scanner), errno != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+	}
+
+	/* Lines are <oid> for commits, <oid> <path> for trees and blobs */
+	while (getline(&line, &n, objects) >= 0) {
+		char type[16], *path;
+		size_t size;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (path = strchr(line, ' '), path != NULL) {
+			*path++ = '\0';
+		}
+
+		/* Fail closed, an object listed but not inspected would be neither measured nor scanned */
+		if (git_host_policy_request(&batch, "info", line, type, &size) != 0) {
+			errx(EXIT_FAILURE, "git cat-file: Unable to inspect %s", line);
+		}
+
+		if (strcmp(type, "commit") == 0 && policy.hasmessage) {
+			char * const commit = git_host_policy_contents(&batch, line, &size);
+			char *subject = strstr(commit, "\n\n");
+
+			subject = subject != NULL ? subject + 2 : "";
+			subject[strcspn(subject, "\n")] = '\0';
+
+			if (regexec(&policy.message, subject, 0, NULL, 0) != 0) {
+				git_host_policy_violation(&scanner, "%.12s: Commit message '%s' does not match the policy", line, subject);
+			}
+
+			free(commit);
+		} else if (strcmp(type, "blob") == 0 && path != NULL) {
+			/* Blobs are only walked once, under the first path naming them, enough for their size and contents */
+			if (policy.maxfilesize != 0 && size > policy.maxfilesize) {
+				git_host_policy_violation(&scanner, "%s: File too large, %zu bytes exceeds %llu", path, size, policy.maxfilesize);
+			} else if (threads != 0) {
+				struct git_host_policy_blob * const blob = malloc(sizeof (*blob));
+
+				if (blob == NULL) {
+					err(EXIT_FAILURE, "malloc");
+				}
+
+				blob->path = xstrdup(path);
+				blob->data = git_host_policy_contents(&batch, line, &blob->size);
+				git_host_policy_queue(&scanner, blob);
+			}
+		}
+	}
+
+	free(line);
+	fclose(objects);
+	fclose(batch.commands);
+	fclose(batch.responses);
+	free(batch.line);
+
+	pthread_mutex_lock(&scanner.mutex);
+	scanner.done = 1;
+	pthread_cond_broadcast(&scanner.available);
+	pthread_mutex_unlock(&scanner.mutex);
+
+	for (unsigned int i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	if (policy.forbiddencount != 0) {
+		git_host_policy_paths(&scanner, tips, tipscount);
+	}
+
+	/* Fail closed, objects which could not be walked were not checked */
+	if (git_host_wait(revpid) != 0 || git_host_wait(catpid) != 0) {
+		errx(EXIT_FAILURE, "Unable to check pushed objects against the policy");
+	}
+
+	if (scanner.violations != 0) {
+		errx(EXIT_FAILURE, "Push rejected, %u policy violation(s)", scanner.violations);
+	}
+
+	exit(EXIT_SUCCESS);
 }
 
 static void noreturn
-git_host_exec(int argc, char **argv) {
+git_host_hook_post_receive(int argc, char **argv) {
+	/* Journals each updated ref as <repository> <ref> <old> <new> <user> <timestamp> */
+	const char * const repository = getenv("GIT_HOST_REPOSITORY");
+	const char *user = getenv("SSH_AUTHORIZED_BY");
+	char **payloads = NULL, *line = NULL;
+	int count = 0;
+	size_t n = 0;
+
+	if (user == NULL) {
+		user = "-";
+	}
+
+	while (getline(&line, &n, stdin) >= 0) {
+		char *saveptr, *payload;
+
+		const char * const old = strtok_r(line, " \n", &saveptr);
+		const char * const new = strtok_r(NULL, " \n", &saveptr);
+		const char * const ref = strtok_r(NULL, " \n", &saveptr);
+
+		if (ref != NULL) {
+			if (asprintf(&payload, "%s %s %s %s %s %lld", repository, ref, old, new, user, (long long)time(NULL)) < 0) {
+				err(EXIT_FAILURE, "asprintf");
+			}
+			git_host_array_push(payload, &count, &payloads);
+		}
+	}
+	free(line);
+
+	git_host_journal_append(payloads, count);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+git_host_hook(int argc, char **argv) {
 	static const struct {
 		const char * const name;
-		void (* const exec)(int, char **);
+		void (* const hook)(int, char **);
+	} hooks[] = {
+		{ "post-receive", git_host_hook_post_receive },
+		{ "pre-receive",  git_host_hook_pre_receive },
+	};
+	const unsigned int hookscount = sizeof (hooks) / sizeof (*hooks);
+	const char * const name = basename(*argv);
+	unsigned int i = 0;
+
+	while (i < hookscount && strcmp(name, hooks[i].name) != 0) {
+		i++;
+	}
+
+	if (i == hookscount) {
+		return;
+	}
+
+	/* Not run through git-host, for example a push local to the server */
+	if (getenv("GIT_HOST_REPOSITORY") == NULL) {
+		exit(EXIT_SUCCESS);
+	}
+
+	/* Git runs hooks from the repository with a relative GIT_DIR, keep it valid from the home directory */
+	const char * const gitdir = getenv("GIT_DIR");
+	char * const absolute = realpath(gitdir != NULL ? gitdir : ".", NULL);
+	if (absolute == NULL || setenv("GIT_DIR", absolute, 1) != 0) {
+		err(EXIT_FAILURE, "GIT_DIR");
+	}
+	free(absolute);
+
+	git_host_chdir_home();
+
+	hooks[i].hook(argc, argv);
+	abort();
+}
+
+static void noreturn
+git_host_maintenance(int argc, char **argv) {
+	static const struct {
+		const char * const name;
+		void (* const maintenance)(int, char **);
+		const enum git_host_class class;
 	} commands[] = {
-		{ "dir",                git_host_exec_dir },
-		{ "init",               git_host_exec_init },
-		{ "git-receive-pack",   git_host_exec_git_receive_pack },
-		{ "git-upload-archive", git_host_exec_git_upload_X },
-		{ "git-upload-pack",    git_host_exec_git_upload_X },
+		{ "acl-compile",     git_host_maintenance_acl_compile,     GIT_HOST_CLASS_BACKGROUND },
+		{ "backup",          git_host_maintenance_backup,          GIT_HOST_CLASS_BACKGROUND },
+		{ "broker",          git_host_maintenance_broker,          GIT_HOST_CLASS_INTERACTIVE },
+		{ "hibernate",       git_host_maintenance_hibernate,       GIT_HOST_CLASS_BACKGROUND },
+		{ "install-hooks",   git_host_maintenance_install_hooks,   GIT_HOST_CLASS_BACKGROUND },
+		{ "journal",         git_host_maintenance_journal,         GIT_HOST_CLASS_BACKGROUND },
+		{ "migrate",         git_host_maintenance_migrate,         GIT_HOST_CLASS_BACKGROUND },
+		{ "migrate-refs",    git_host_maintenance_migrate_refs,    GIT_HOST_CLASS_BACKGROUND },
+		{ "profile",         git_host_maintenance_profile,         GIT_HOST_CLASS_BACKGROUND },
+		{ "quota-reconcile", git_host_maintenance_quota_reconcile, GIT_HOST_CLASS_BACKGROUND },
+		{ "reap",            git_host_maintenance_reap,            GIT_HOST_CLASS_BACKGROUND },
+		{ "replicate",       git_host_maintenance_replicate,       GIT_HOST_CLASS_BACKGROUND },
+		{ "restore",         git_host_maintenance_restore,         GIT_HOST_CLASS_BACKGROUND },
+		{ "stats",           git_host_maintenance_stats,           GIT_HOST_CLASS_BACKGROUND },
+		{ "tier",            git_host_maintenance_tier,            GIT_HOST_CLASS_BACKGROUND },
 	};
 	const unsigned int commandscount = sizeof (commands) / sizeof (*commands);
 	unsigned int i = 0;
 
+	/* Maintenance is run locally, from wherever, but paths are relative to the git user's home */
+	git_host_chdir_home();
+
 	while (i < commandscount && strcmp(*argv, commands[i].name) != 0) {
 		i++;
 	}
 
 	if (i == commandscount) {
-		errx(EXIT_FAILURE, "Invalid command '%s'", *argv);
+		errx(EXIT_FAILURE, "Invalid maintenance command '%s'", *argv);
 	}
 
-	commands[i].exec(argc, argv);
+	const struct passwd * const pw = getpwuid(getuid());
+	git_host_cgroup(pw != NULL ? pw->pw_name : "-", commands[i].name, commands[i].class);
+	git_host_priority(commands[i].class);
+
+	commands[i].maintenance(argc, argv);
 	abort();
 }
 
 static void noreturn
 git_host_usage(const char *progname) {
-	fprintf(stderr, "usage: %s [-c <command>]\n", progname);
+	fprintf(stderr, "usage: %s -c <command>\n"
+		"       %s -m <maintenance command>\n", progname, progname);
 	exit(EXIT_FAILURE);
 }
 
@@ -407,14 +7005,18 @@ static const struct git_host_args
 git_host_parse_args(int argc, char **argv) {
 	struct git_host_args args = {
 		.command = NULL,
+		.maintenance = NULL,
 	};
 	int c;
 
-	while ((c = getopt(argc, argv, ":c:")) >= 0) {
+	while ((c = getopt(argc, argv, ":c:m:")) >= 0) {
 		switch (c) {
 		case 'c':
 			args.command = optarg;
 			break;
+		case 'm':
+			args.maintenance = optarg;
+			break;
 		case ':':
 			warnx("-%c: Missing argument", optopt);
 			git_host_usage(*argv);
@@ -424,8 +7026,8 @@ git_host_parse_args(int argc, char **argv) {
 		}
 	}
 
-	if (args.command == NULL) {
-		warnx("Missing command");
+	if ((args.command == NULL) == (args.maintenance == NULL)) {
+		warnx("Expected exactly one command");
 		git_host_usage(*argv);
 	}
 
@@ -439,10 +7041,22 @@ git_host_parse_args(int argc, char **argv) {
 
 int
 main(int argc, char *argv[]) {
-	const struct git_host_args args = git_host_parse_args(argc, argv);
 	char **arguments;
 	int count;
 
+	/* Returns unless invoked as one of the repositories' hooks */
+	git_host_hook(argc, argv);
+
+	const struct git_host_args args = git_host_parse_args(argc, argv);
+
+	if (args.maintenance != NULL) {
+		git_host_expand_command(args.maintenance, &count, &arguments);
+		git_host_maintenance(count, arguments);
+	}
+
+	/* Returns unless a broker runs the session */
+	git_host_broker_submit(args.command);
+
 	git_host_expand_command(args.command, &count, &arguments);
 	git_host_exec(count, arguments);
 }
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#include "hmac-sha256.h"
+
+#include <string.h>
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void
+sha256_block(struct sha256 *ctx, const uint8_t block[SHA256_BLOCK_SIZE]) {
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+			| (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+
+	for (int i = 16; i < 64; i++) {
+		const uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ w[i - 15] >> 3;
+		const uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ w[i - 2] >> 10;
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+	for (int i = 0; i < 64; i++) {
+		const uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		const uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void
+sha256_init(struct sha256 *ctx) {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, initial, sizeof (initial));
+	ctx->length = 0;
+	ctx->blocklen = 0;
+}
+
+void
+sha256_update(struct sha256 *ctx, const void *data, size_t size) {
+	const uint8_t *it = data;
+
+	ctx->length += size;
+
+	while (size != 0) {
+		const size_t chunk = size < SHA256_BLOCK_SIZE - ctx->blocklen ? size : SHA256_BLOCK_SIZE - ctx->blocklen;
+
+		memcpy(ctx->block + ctx->blocklen, it, chunk);
+		ctx->blocklen += chunk;
+		it += chunk;
+		size -= chunk;
+
+		if (ctx->blocklen == SHA256_BLOCK_SIZE) {
+			sha256_block(ctx, ctx->block);
+			ctx->blocklen = 0;
+		}
+	}
+}
+
+void
+sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+	const uint64_t bits = ctx->length * 8;
+
+	ctx->block[ctx->blocklen++] = 0x80;
+	if (ctx->blocklen > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->block + ctx->blocklen, 0, SHA256_BLOCK_SIZE - ctx->blocklen);
+		sha256_block(ctx, ctx->block);
+		ctx->blocklen = 0;
+	}
+
+	memset(ctx->block + ctx->blocklen, 0, SHA256_BLOCK_SIZE - 8 - ctx->blocklen);
+	for (int i = 0; i < 8; i++) {
+		ctx->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+	}
+	sha256_block(ctx, ctx->block);
+
+	for (int i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+}
+
+void
+hmac_sha256(const void *key, size_t keysize, const void *data, size_t size, uint8_t mac[SHA256_DIGEST_SIZE]) {
+	uint8_t pad[SHA256_BLOCK_SIZE] = { 0 }, inner[SHA256_DIGEST_SIZE];
+	struct sha256 ctx;
+
+	if (keysize > SHA256_BLOCK_SIZE) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, key, keysize);
+		sha256_final(&ctx, pad);
+	} else {
+		memcpy(pad, key, keysize);
+	}
+
+	for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+		pad[i] ^= 0x36;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, sizeof (pad));
+	sha256_update(&ctx, data, size);
+	sha256_final(&ctx, inner);
+
+	for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, pad, sizeof (pad));
+	sha256_update(&ctx, inner, sizeof (inner));
+	sha256_final(&ctx, mac);
+}
+
+void
+hmac_sha256_hex(const void *key, size_t keysize, const void *data, size_t size, char hex[SHA256_DIGEST_SIZE * 2 + 1]) {
+	static const char digits[] = "0123456789abcdef";
+	uint8_t mac[SHA256_DIGEST_SIZE];
+
+	hmac_sha256(key, keysize, data, size, mac);
+
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		hex[i * 2] = digits[mac[i] >> 4];
+		hex[i * 2 + 1] = digits[mac[i] & 0xf];
+	}
+	hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+int
+hmac_sha256_hex_equals(const char *lhs, const char *rhs) {
+	/* Constant time, for a same length, so a forger can't guess the mac byte after byte */
+	const size_t length = strlen(lhs);
+	unsigned char difference = 0;
+
+	if (strlen(rhs) != length) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < length; i++) {
+		difference |= lhs[i] ^ rhs[i];
+	}
+
+	return difference == 0;
+}
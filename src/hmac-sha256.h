@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef HMAC_SHA256_H
+#define HMAC_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t block[SHA256_BLOCK_SIZE];
+	size_t blocklen;
+};
+
+void
+sha256_init(struct sha256 *ctx);
+
+void
+sha256_update(struct sha256 *ctx, const void *data, size_t size);
+
+void
+sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void
+hmac_sha256(const void *key, size_t keysize, const void *data, size_t size, uint8_t mac[SHA256_DIGEST_SIZE]);
+
+/* Hex encoded HMAC-SHA256 of data, as found in authorization tokens */
+void
+hmac_sha256_hex(const void *key, size_t keysize, const void *data, size_t size, char hex[SHA256_DIGEST_SIZE * 2 + 1]);
+
+int
+hmac_sha256_hex_equals(const char *lhs, const char *rhs);
+
+#endif
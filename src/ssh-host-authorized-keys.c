@@ -5,6 +5,7 @@
 #include <stdnoreturn.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <ctype.h>
 #include <errno.h>
@@ -12,9 +13,15 @@
 #include <pwd.h>
 #include <err.h>
 
+#include "git-host-acl.h"
+#include "git-host-probe.h"
+#include "hmac-sha256.h"
+
 struct ssh_host_authorized_keys_args {
 	const char *keytype;
 	const char *group;
+	const char *tokenkey;
+	const char *database;
 };
 
 static const char * const sshd_authorized_keys_types[] = {
@@ -159,6 +166,7 @@ ssh_host_authorized_keys_user(const struct passwd *pw, const char *keytype, cons
 	memcpy(authorizedkeys + homelen, authorizedkeysfile, sizeof (authorizedkeysfile));
 
 	FILE * const filep = fopen(authorizedkeys, "r");
+	GIT_HOST_PROBE(ssh_host_authorized_keys, file, pw->pw_name, (const char *)authorizedkeys, filep != NULL ? 0 : errno);
 	if (filep != NULL) {
 		char *line = NULL;
 		size_t n = 0;
@@ -170,6 +178,7 @@ ssh_host_authorized_keys_user(const struct passwd *pw, const char *keytype, cons
 			if (*entry != '#' && *entry != '\n') {
 				if (ssh_host_authorized_keys_skip_options(&entry) != 0 && entry != line) {
 					/* Invalid options parsing */
+					GIT_HOST_PROBE(ssh_host_authorized_keys, reject, pw->pw_name, line, 1);
 					continue;
 				}
 
@@ -179,6 +188,7 @@ ssh_host_authorized_keys_user(const struct passwd *pw, const char *keytype, cons
 
 				if (ssh_host_authorized_keys_entry_field_matches(keytype, &entry) != 0) {
 					/* Invalid keytype */
+					GIT_HOST_PROBE(ssh_host_authorized_keys, reject, pw->pw_name, line, 2);
 					continue;
 				}
 
@@ -188,9 +198,11 @@ ssh_host_authorized_keys_user(const struct passwd *pw, const char *keytype, cons
 
 				if (ssh_host_authorized_keys_entry_field_matches(key, &entry) != 0) {
 					/* Invalid key */
+					GIT_HOST_PROBE(ssh_host_authorized_keys, reject, pw->pw_name, line, 3);
 					continue;
 				}
 
+				GIT_HOST_PROBE(ssh_host_authorized_keys, match, pw->pw_name, line);
 				ret = 0;
 				break;
 			}
@@ -203,9 +215,94 @@ ssh_host_authorized_keys_user(const struct passwd *pw, const char *keytype, cons
 	return ret;
 }
 
+static char *
+ssh_host_authorized_keys_token(const struct ssh_host_authorized_keys_args *args, const struct passwd *pw) {
+	/* Signs <user>:<epoch>:<group>,..., so git-host can trust the user's groups without the name service */
+	unsigned long long epoch = 0;
+	char key[4096], *groups = NULL, *message, *token;
+	size_t keysize = 0, groupslen = 0;
+	ssize_t readed;
+	int fd;
+
+	if (fd = open(args->tokenkey, O_RDONLY | O_CLOEXEC), fd < 0) {
+		syslog(LOG_ERR, "open %s: %m", args->tokenkey);
+		return NULL;
+	}
+
+	while (readed = read(fd, key + keysize, sizeof (key) - keysize), readed > 0) {
+		keysize += readed;
+	}
+	close(fd);
+
+	if (readed < 0 || keysize == 0) {
+		syslog(LOG_ERR, "Unable to read token key %s", args->tokenkey);
+		return NULL;
+	}
+
+	/* Tokens are stale as soon as access rules are recompiled, a missing database is epoch zero */
+	if (args->database != NULL && (fd = open(args->database, O_RDONLY | O_CLOEXEC)) >= 0) {
+		struct git_host_acl_header header;
+
+		if (read(fd, &header, sizeof (header)) == sizeof (header)
+			&& memcmp(header.magic, GIT_HOST_ACL_MAGIC, sizeof (header.magic)) == 0) {
+			epoch = header.epoch;
+		}
+		close(fd);
+	}
+
+	gid_t *gids = NULL;
+	int ngids = 0;
+
+	while (getgrouplist(pw->pw_name, pw->pw_gid, gids, &ngids) < 0) {
+		gids = realloc(gids, sizeof (*gids) * ngids);
+		if (gids == NULL) {
+			syslog(LOG_ERR, "realloc: %m");
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < ngids; i++) {
+		const struct group * const gr = getgrgid(gids[i]);
+
+		if (gr != NULL && strpbrk(gr->gr_name, ",:\"") == NULL) {
+			const size_t namelen = strlen(gr->gr_name);
+
+			groups = realloc(groups, groupslen + namelen + 2);
+			if (groups == NULL) {
+				syslog(LOG_ERR, "realloc: %m");
+				return NULL;
+			}
+
+			if (groupslen != 0) {
+				groups[groupslen++] = ',';
+			}
+			memcpy(groups + groupslen, gr->gr_name, namelen + 1);
+			groupslen += namelen;
+		}
+	}
+	free(gids);
+
+	if (asprintf(&message, "%s:%llu:%s", pw->pw_name, epoch, groups != NULL ? groups : "") < 0) {
+		syslog(LOG_ERR, "asprintf: %m");
+		return NULL;
+	}
+	free(groups);
+
+	char mac[SHA256_DIGEST_SIZE * 2 + 1];
+	hmac_sha256_hex(key, keysize, message, strlen(message), mac);
+
+	if (asprintf(&token, "%s:%s", message + strlen(pw->pw_name) + 1, mac) < 0) {
+		syslog(LOG_ERR, "asprintf: %m");
+		token = NULL;
+	}
+	free(message);
+
+	return token;
+}
+
 static void noreturn
 ssh_host_authorized_keys_usage(const char *progname) {
-	fprintf(stderr, "usage: %s -G <group> -t <keytype> <key>\n", progname);
+	fprintf(stderr, "usage: %s -G <group> -t <keytype> [-k <token key> [-a <access database>]] <key>\n", progname);
 	exit(EXIT_FAILURE);
 }
 
@@ -214,11 +311,19 @@ ssh_host_authorized_keys_parse_args(int argc, char **argv) {
 	struct ssh_host_authorized_keys_args args = {
 		.keytype = NULL,
 		.group = NULL,
+		.tokenkey = NULL,
+		.database = NULL,
 	};
 	int c;
 
-	while ((c = getopt(argc, argv, ":G:t:")) >= 0) {
+	while ((c = getopt(argc, argv, ":G:t:k:a:")) >= 0) {
 		switch (c) {
+		case 'a':
+			args.database = optarg;
+			break;
+		case 'k':
+			args.tokenkey = optarg;
+			break;
 		case 'G':
 			args.group = optarg;
 			break;
@@ -316,8 +421,20 @@ main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	/* Print authorized key entry, with user name in environment variables */
-	printf("environment=\"SSH_AUTHORIZED_BY=%s\" %s %s\n", pw->pw_name, args.keytype, key);
+	/* Print authorized key entry, with user name and optional token in environment variables */
+	if (args.tokenkey != NULL) {
+		char * const token = ssh_host_authorized_keys_token(&args, pw);
+
+		if (token == NULL) {
+			return EXIT_FAILURE;
+		}
+
+		printf("environment=\"SSH_AUTHORIZED_BY=%s\",environment=\"SSH_AUTHORIZED_TOKEN=%s\" %s %s\n",
+			pw->pw_name, token, args.keytype, key);
+		free(token);
+	} else {
+		printf("environment=\"SSH_AUTHORIZED_BY=%s\" %s %s\n", pw->pw_name, args.keytype, key);
+	}
 
 	return EXIT_SUCCESS;
 }